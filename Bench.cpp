@@ -0,0 +1,596 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include "Utils.h"
+#include "CImg.h"
+#include "Equaliser.h"
+
+
+using namespace cimg_library;
+
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : only benchmark this platform (default: all)" << std::endl;
+	std::cerr << "  -d : only benchmark this device of the platform (default: all)" << std::endl;
+	std::cerr << "  -w : warmup iterations, excluded from the results (default: 3)" << std::endl;
+	std::cerr << "  -i : measured iterations (default: 20)" << std::endl;
+	std::cerr << "  -m : comma separated synthetic image sizes in megapixels (default: 0.1,1,4,16,64,100)" << std::endl;
+	std::cerr << "  -x : comma separated synthetic pixel distributions, uniform, gaussian and/or single (default: all three)" << std::endl;
+	std::cerr << "  -b : comma separated bin counts (default: 64,256,1024,4096)" << std::endl;
+	std::cerr << "  -u : comma separated limits on the compute units the histogram uses, 0 - all (default: 0), for scaling runs" << std::endl;
+	std::cerr << "  -e : error bound of the sampled histogram, timed and compared with the exact one (default: 0.05)" << std::endl;
+	std::cerr << "  -a : CLAHE tile grid timed against the global equalisation, n x n tiles (default: 8, 0 - skip)" << std::endl;
+	std::cerr << "  -c : also write the results to a CSV file" << std::endl;
+	std::cerr << "  -t : autotune instead: sweep the launch parameters of every kernel for each bin count on a synthetic" << std::endl;
+	std::cerr << "       image of the first -m size (default: 4) and save the fastest to the device's tuning file" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+template <typename T>
+vector<T> ParseList(const string& text) {
+	vector<T> values;
+	stringstream sstream(text);
+	string item;
+	while (getline(sstream, item, ','))
+		values.push_back((T)atof(item.c_str()));
+	return values;
+}
+
+//nearest-rank percentile of a set of samples
+double Percentile(vector<double> samples, double percent) {
+	if (samples.empty())
+		return 0.0;
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)ceil(percent/100.0*samples.size());
+	return samples[std::max((size_t)1, rank) - 1];
+}
+
+vector<string> SplitList(const string& text) {
+	vector<string> items;
+	stringstream sstream(text);
+	string item;
+	while (getline(sstream, item, ','))
+		items.push_back(item);
+	return items;
+}
+
+//a benchmark input, either one of the bundled images or synthetic noise of a given size
+struct BenchImage {
+	string name;
+	CImg<unsigned char> image;
+};
+
+//deterministic noise so that runs are comparable across machines and days. the distribution decides how much the
+//histogram atomics contend: uniform spreads them over every bin, gaussian (mean 128, sigma 24) over a few dozen
+//and single puts every pixel at 16, a flat dark frame
+CImg<unsigned char> SyntheticImage(int width, int height, int channels, unsigned int seed, const string& distribution = "uniform") {
+	CImg<unsigned char> image(width, height, 1, channels);
+	unsigned int state = seed;
+	unsigned char* data = image.data();
+	for (size_t i = 0; i < image.size(); i++) {
+		state = state*1664525u + 1013904223u;
+		if (distribution == "single")
+			data[i] = 16;
+		else if (distribution == "gaussian") {
+			//Box-Muller from two draws of the generator
+			double u1 = ((state >> 8) + 1.0)/16777217.0;
+			state = state*1664525u + 1013904223u;
+			double u2 = (state >> 8)/16777216.0;
+			double value = 128.0 + 24.0*sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+			data[i] = (unsigned char)std::min(255.0, std::max(0.0, value + 0.5));
+		}
+		else
+			data[i] = (unsigned char)(state >> 24);
+	}
+	return image;
+}
+
+//latency samples per stage for one (device, image, bins) configuration
+typedef map<string, vector<double> > Samples;
+
+//move the execution time [us] of every recorded command into the samples of its stage
+void TakeSamples(Profiler& profiler, Samples& samples) {
+	for (size_t i = 0; i < profiler.pending.size(); i++) {
+		const cl::Event& event = profiler.pending[i].event;
+		double executed = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>())/1000.0;
+		samples[profiler.pending[i].name].push_back(executed);
+	}
+	profiler.pending.clear();
+}
+
+//tag the stage names recorded from `from` on with the variant of the chain that enqueued them, so that a stage
+//several chains share (reduceHistogram, scanLocal, cdfToLut...) gets samples per variant instead of one mixed set.
+//names that already say which variant they are (HistogramStageName) are left alone
+void LabelVariant(Profiler& profiler, size_t from, const string& variant) {
+	string suffix = " (" + variant + ")";
+	for (size_t i = from; i < profiler.pending.size(); i++) {
+		string& name = profiler.pending[i].name;
+		if (name.find(suffix) == string::npos)
+			name += suffix;
+	}
+}
+
+//total execution time [us] of the commands recorded by the profiler since it was last cleared
+double CommandTime(Profiler& profiler) {
+	double total = 0.0;
+	for (size_t i = 0; i < profiler.pending.size(); i++) {
+		const cl::Event& event = profiler.pending[i].event;
+		total += (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>())/1000.0;
+	}
+	profiler.pending.clear();
+	return total;
+}
+
+//an image on the device for the autotuner, with its grey plane and output buffers
+struct TuneImage {
+	int channels;
+	int numPixels;
+	int maxValue;
+	cl::Buffer input;
+	cl::Buffer grey;
+	cl::Buffer output;
+};
+
+//median time [us] of the commands one call of enqueue records, summed over the images
+double TimeLaunch(Equaliser& equaliser, vector<TuneImage>& images, int warmup, int iterations, const std::function<void(TuneImage&, const cl::Event&)>& enqueue) {
+	double total = 0.0;
+	for (size_t i = 0; i < images.size(); i++) {
+		vector<double> times;
+		for (int k = 0; k < warmup + iterations; k++) {
+			cl::Event ready;
+			equaliser.queue.enqueueMarkerWithWaitList(NULL, &ready);
+			equaliser.profiler.pending.clear();
+			enqueue(images[i], ready);
+			equaliser.queue.finish();
+			double time = CommandTime(equaliser.profiler);
+			if (k >= warmup)
+				times.push_back(time);
+		}
+		total += Percentile(times, 50.0);
+	}
+	return total;
+}
+
+//work-group sizes worth trying up to a kernel's limit, 0 - left to the runtime
+vector<int> LocalSizes(size_t limit, bool runtime) {
+	vector<int> sizes;
+	if (runtime)
+		sizes.push_back(0);
+	for (int size = 32; size <= 1024; size *= 2)
+		if ((size_t)size <= limit)
+			sizes.push_back(size);
+	return sizes;
+}
+
+//sweep the launch parameters of the histogram, rgb2grey and back projection kernels on a grey and a colour image
+//and store the fastest combination of each in tuning. the kernels are timed with profiling events, so the
+//transfers do not get in the way
+void Autotune(Equaliser& equaliser, double megapixels, int warmup, int iterations, Tuning& tuning) {
+	int side = (int)sqrt(megapixels*1e6);
+	vector<TuneImage> images;
+	for (int channels = 1; channels <= 3; channels += 2) {
+		CImg<unsigned char> image = SyntheticImage(side, side, channels, 12345u);
+		TuneImage tune;
+		tune.channels = channels;
+		tune.numPixels = side*side;
+		tune.maxValue = MaxValue(IntensityMax(image, equaliser.options.colourSpace));
+		tune.input = equaliser.pool.Acquire(CL_MEM_READ_ONLY, image.size());
+		tune.grey = equaliser.pool.Acquire(CL_MEM_READ_WRITE, tune.numPixels);
+		tune.output = equaliser.pool.Acquire(CL_MEM_READ_WRITE, image.size());
+		equaliser.queue.enqueueWriteBuffer(tune.input, CL_TRUE, 0, image.size(), image.data());
+		images.push_back(tune);
+	}
+	EqualiserOptions& options = equaliser.options;
+	options.profile = equaliser.profiler.enabled = true;
+	equaliser.profiler.print_events = false;
+
+	//histogram: work-group size, work-groups per compute unit (and so pixels per work-item) and local replicas
+	cl::Kernel histColour(equaliser.program, equaliser.ColourHistogramKernelName());
+	size_t histLimit = std::min(equaliser.histKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(equaliser.device),
+		histColour.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(equaliser.device));
+	vector<int> best_hist;
+	double best_hist_us = 0.0;
+	vector<int> local_sizes = LocalSizes(histLimit, false);
+	for (size_t l = 0; l < local_sizes.size(); l++) {
+		for (int groups = 1; groups <= 16; groups *= 2) {
+			for (int replicas = 1; replicas <= (equaliser.globalBins ? 1 : 16); replicas *= 2) {
+				options.histLocalSize = local_sizes[l];
+				options.groupsPerUnit = groups;
+				options.maxReplicas = replicas;
+				equaliser.ConfigureHistogram(false);
+				//combinations the device cannot do end up as one it can, which gets timed on its own
+				if ((equaliser.histLocalSize != local_sizes[l]) || (equaliser.replicas != replicas))
+					continue;
+
+				double us = TimeLaunch(equaliser, images, warmup, iterations, [&](TuneImage& image, const cl::Event& ready) {
+					cl::Event done;
+					equaliser.EnqueueHistogramTotal(image.input, image.channels, image.numPixels, image.maxValue, false, ready, done, &image.grey);
+				});
+				if (best_hist.empty() || (us < best_hist_us)) {
+					int values[] = { local_sizes[l], groups, replicas };
+					best_hist.assign(values, values + 3);
+					best_hist_us = us;
+				}
+			}
+		}
+	}
+
+	//rgb2grey: work-group size, each work-item converts a fixed vector of pixels
+	TuneImage& colour = images[1];
+	cl::Kernel& rgb2grey = equaliser.Colour(colour.channels, LAYOUT_PLANAR).rgb2grey;
+	vector<int> best_grey;
+	double best_grey_us = 0.0;
+	local_sizes = LocalSizes(rgb2grey.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(equaliser.device), true);
+	for (size_t l = 0; l < local_sizes.size(); l++) {
+		options.greyLocalSize = local_sizes[l];
+		vector<TuneImage> colour_only(1, colour);
+		double us = TimeLaunch(equaliser, colour_only, warmup, iterations, [&](TuneImage& image, const cl::Event& ready) {
+			vector<cl::Event> wait(1, ready);
+			equaliser.EnqueueRGB2Grey(image.input, image.grey, image.numPixels, image.channels, &wait, NULL);
+		});
+		if (best_grey.empty() || (us < best_grey_us)) {
+			best_grey.assign(1, local_sizes[l]);
+			best_grey_us = us;
+		}
+	}
+
+	//back projection: work-group size and pixels per work-item, through whatever LUT the last histogram left
+	cl::Event counted, lut;
+	equaliser.queue.enqueueMarkerWithWaitList(NULL, &counted);
+	equaliser.EnqueueLutFromHistogram(images[0].maxValue, counted, lut);
+	size_t projLimit = std::min(equaliser.backProjGrey.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(equaliser.device),
+		equaliser.Colour(colour.channels, LAYOUT_PLANAR).backProjection.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(equaliser.device));
+	vector<int> best_proj;
+	double best_proj_us = 0.0;
+	local_sizes = LocalSizes(projLimit, true);
+	for (size_t l = 0; l < local_sizes.size(); l++) {
+		for (int pixels = 1; pixels <= 16; pixels *= 2) {
+			options.projLocalSize = local_sizes[l];
+			options.projPixelsPerItem = pixels;
+			double us = TimeLaunch(equaliser, images, warmup, iterations, [&](TuneImage& image, const cl::Event& ready) {
+				vector<cl::Event> wait(1, ready);
+				equaliser.EnqueueBackProjection(image.input, image.output, image.channels, image.numPixels, image.maxValue, &wait, NULL);
+			});
+			if (best_proj.empty() || (us < best_proj_us)) {
+				int values[] = { local_sizes[l], pixels };
+				best_proj.assign(values, values + 2);
+				best_proj_us = us;
+			}
+		}
+	}
+
+	tuning.Set(equaliser.TuningKey("histogram"), best_hist);
+	tuning.Set(equaliser.TuningKey("rgb2grey"), best_grey);
+	tuning.Set(equaliser.TuningKey("backprojection"), best_proj);
+	std::cout << "  histogram (local size, groups per unit, replicas) " << best_hist << ": " << best_hist_us << " us" << std::endl;
+	std::cout << "  rgb2grey (local size) " << best_grey << ": " << best_grey_us << " us" << std::endl;
+	std::cout << "  back projection (local size, pixels per item) " << best_proj << ": " << best_proj_us << " us" << std::endl;
+
+	//leave the equaliser as a production run would find it
+	equaliser.ApplyTuning(tuning);
+	equaliser.ConfigureHistogram(false);
+	for (size_t i = 0; i < images.size(); i++) {
+		equaliser.pool.Release(images[i].input);
+		equaliser.pool.Release(images[i].grey);
+		equaliser.pool.Release(images[i].output);
+	}
+}
+
+//L1 distance between the normalised exact histogram of an image on the device and the one sampled for sample_error
+double SampledHistogramL1(Equaliser& equaliser, const cl::Buffer& input, const cl::Buffer& grey, int channels, int numPixels, int maxValue, float sample_error) {
+	vector<vector<int> > histograms(2, vector<int>(equaliser.numBins));
+	for (int sampled = 0; sampled < 2; sampled++) {
+		equaliser.options.sampleError = sampled ? sample_error : 0.0f;
+		equaliser.SetSampling(numPixels, channels);
+		cl::Event ready, counted;
+		equaliser.queue.enqueueMarkerWithWaitList(NULL, &ready);
+		equaliser.EnqueueHistogramTotal(input, channels, numPixels, maxValue, false, ready, counted, &grey);
+		vector<cl::Event> wait(1, counted);
+		equaliser.queue.enqueueReadBuffer(equaliser.hist_buffer, CL_TRUE, 0, equaliser.numBins*sizeof(int), &histograms[sampled][0], &wait);
+	}
+	equaliser.options.sampleError = 0.0f;
+	equaliser.sampleStride = 1;
+	equaliser.profiler.pending.clear();
+
+	double totals[2] = { 0.0, 0.0 };
+	for (int sampled = 0; sampled < 2; sampled++)
+		for (int bin = 0; bin < equaliser.numBins; bin++)
+			totals[sampled] += histograms[sampled][bin];
+	double l1 = 0.0;
+	for (int bin = 0; bin < equaliser.numBins; bin++)
+		l1 += fabs(histograms[0][bin]/std::max(1.0, totals[0]) - histograms[1][bin]/std::max(1.0, totals[1]));
+	return l1;
+}
+
+//time every kernel stage of the equaliser on one image, plus the full Run() pipeline. the sampled histogram is
+//timed too, and its L1 error against the exact one goes to sampled_l1 (-1 when the kernels are not timed). CLAHE
+//over clahe_tiles x clahe_tiles tiles is timed next to the global equalisation, kernels and pipeline
+Samples BenchImageOnDevice(Equaliser& equaliser, const CImg<unsigned char>& image, int warmup, int iterations, float sample_error, int clahe_tiles, double& sampled_l1) {
+	Samples samples;
+	int channels = image.spectrum();
+	int numPixels = image.width()*image.height()*image.depth();
+	int maxValue = MaxValue(IntensityMax(image, equaliser.options.colourSpace));
+
+	//kernels are timed on the whole image, so only when it fits the device - the same test Run() tiles by, so that the
+	//per-kernel and pipeline rows time the same path
+	bool per_kernel = !equaliser.NeedsTiling(image.width(), image.height()*image.depth(), channels);
+	//the four histograms of channelHistograms live in local memory together
+	bool channel_stats = (channels >= 3) && equaliser.ChannelHistogramsFit();
+	//binned over the range of the brightest channel, which the luma range above does not cover
+	int channelMax = channel_stats ? MaxValue((int)image.get_shared_channels(0, 2).max()) : 0;
+	cl::Buffer input, output, grey, histograms;
+	if (per_kernel) {
+		if (channel_stats)
+			histograms = equaliser.pool.Acquire(CL_MEM_READ_WRITE, 4*equaliser.numBins*sizeof(int));
+		input = equaliser.pool.Acquire(CL_MEM_READ_ONLY, image.size());
+		output = equaliser.pool.Acquire(CL_MEM_READ_WRITE, image.size());
+		grey = equaliser.pool.Acquire(CL_MEM_READ_WRITE, numPixels);
+		equaliser.queue.enqueueWriteBuffer(input, CL_TRUE, 0, image.size(), image.data());
+	}
+	//CLAHE keeps its tile histograms in local memory
+	bool clahe = (clahe_tiles > 0) && !equaliser.globalBins;
+	sampled_l1 = per_kernel ? SampledHistogramL1(equaliser, input, grey, channels, numPixels, maxValue, sample_error) : -1.0;
+
+	for (int i = 0; i < warmup + iterations; i++) {
+		if (per_kernel) {
+			equaliser.profiler.enabled = true;
+			equaliser.profiler.pending.clear();
+
+			cl::Event ready, lut;
+			equaliser.queue.enqueueMarkerWithWaitList(NULL, &ready);
+			if (channels >= 3) {
+				//the same bytes pushed through the interleaved converter, for comparison with the planar one
+				cl::Kernel& interleaved = equaliser.Colour(channels, LAYOUT_INTERLEAVED).rgb2grey;
+				cl::Event converted;
+				interleaved.setArg(0, input);
+				interleaved.setArg(1, output);
+				interleaved.setArg(2, numPixels);
+				interleaved.setArg(3, channels);
+				equaliser.queue.enqueueNDRangeKernel(interleaved, cl::NullRange, cl::NDRange(RGB2GreyGlobalSize(LAYOUT_INTERLEAVED, numPixels)), cl::NullRange, NULL, &converted);
+				equaliser.profiler.Add("rgb2greyInterleaved", converted, (double)numPixels*(channels + 1), numPixels);
+			}
+
+			//both variants of each fused stage and both histogram paths, so every kernel of the chain gets timed.
+			//the stages each chain goes through are labelled with it
+			for (int runs = 0; runs < (equaliser.globalBins ? 1 : 2); runs++) {
+				equaliser.mergeRuns = (runs == 1);
+				for (int fused = 0; fused < 2; fused++) {
+					size_t from = equaliser.profiler.pending.size();
+					equaliser.options.fuseHistogram = (fused == 1);
+					equaliser.options.fuseLut = (fused == 1);
+					equaliser.EnqueueLut(input, channels, numPixels, maxValue, ready, lut, &grey);
+					LabelVariant(equaliser.profiler, from, string(fused ? "fused" : "split") + (equaliser.mergeRuns ? "+runs" : ""));
+				}
+			}
+
+			//the approximate histogram: same kernels over a sample of the pixels
+			equaliser.mergeRuns = false;
+			equaliser.options.sampleError = sample_error;
+			equaliser.SetSampling(numPixels, channels);
+			cl::Event sampled;
+			size_t from = equaliser.profiler.pending.size();
+			equaliser.EnqueueHistogramTotal(input, channels, numPixels, maxValue, false, ready, sampled, &grey);
+			LabelVariant(equaliser.profiler, from, "sampled");
+			equaliser.options.sampleError = 0.0f;
+			equaliser.sampleStride = 1;
+
+			//R, G, B and luma in one read, against the single luma histogram above
+			if (channel_stats) {
+				cl::Event counted;
+				equaliser.EnqueueChannelHistograms(input, channels, numPixels, channelMax, histograms, NULL, ready, counted);
+			}
+
+			vector<cl::Event> wait(1, lut);
+			cl::Event projected;
+			equaliser.EnqueueBackProjection(input, output, channels, numPixels, maxValue, &wait, &projected);
+
+			//CLAHE of the same input, against the single histogram chain above
+			if (clahe) {
+				equaliser.options.claheTiles = clahe_tiles;
+				equaliser.EnqueueClahe(input, output, image.width(), image.height()*image.depth(), channels, maxValue, projected, projected);
+				equaliser.options.claheTiles = 0;
+			}
+			projected.wait();
+
+			if (i < warmup)
+				equaliser.profiler.pending.clear();
+			else
+				TakeSamples(equaliser.profiler, samples);
+		}
+
+		//end to end: upload, every stage and the readback
+		equaliser.profiler.enabled = false;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		equaliser.Run(image);
+		double pipeline_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		if (i >= warmup)
+			samples["pipeline"].push_back(pipeline_us);
+
+		//CLAHE needs the whole image on the device, images beyond its limits are reported rather than left out quietly
+		if (clahe && equaliser.NeedsTiling(image.width(), image.height(), channels) && (i == 0))
+			std::cout << "pipeline CLAHE skipped: " << image.width() << "x" << image.height() << "x" << channels
+				<< " exceeds the device's allocation or memory limits" << std::endl;
+		if (clahe && !equaliser.NeedsTiling(image.width(), image.height(), channels)) {
+			equaliser.options.claheTiles = clahe_tiles;
+			start = std::chrono::steady_clock::now();
+			equaliser.Run(image);
+			pipeline_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+			equaliser.options.claheTiles = 0;
+			if (i >= warmup)
+				samples["pipeline CLAHE"].push_back(pipeline_us);
+		}
+	}
+
+	equaliser.pool.Release(input);
+	equaliser.pool.Release(output);
+	equaliser.pool.Release(grey);
+	equaliser.pool.Release(histograms);
+
+	return samples;
+}
+
+int main(int argc, char **argv) {
+	int platform_only = -1;
+	int device_only = -1;
+	int warmup = 3;
+	int iterations = 20;
+	vector<double> megapixels = ParseList<double>("0.1,1,4,16,64,100");
+	vector<int> bin_counts = ParseList<int>("64,256,1024,4096");
+	vector<int> compute_units = ParseList<int>("0");
+	vector<string> distributions = SplitList("uniform,gaussian,single");
+	string csv_file;
+	float sample_error = 0.05f;
+	int clahe_tiles = 8;
+	bool tune = false;
+	bool megapixels_set = false;
+
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_only = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_only = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { warmup = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-i") == 0) && (i < (argc - 1))) { iterations = std::max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { megapixels = ParseList<double>(argv[++i]); megapixels_set = true; }
+		else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { distributions = SplitList(argv[++i]); }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bin_counts = ParseList<int>(argv[++i]); }
+		else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { compute_units = ParseList<int>(argv[++i]); }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { csv_file = argv[++i]; }
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { sample_error = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { clahe_tiles = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-t") == 0) { tune = true; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	}
+
+	cimg::exception_mode(0);
+
+	try {
+		//bundled images first, then grey and colour noise of every requested size and distribution. the autotuner makes its own
+		vector<BenchImage> images;
+		const char* bundled[] = { "test.pgm", "test.ppm", "test_large.ppm", "thispersondoesnotexist.ppm" };
+		for (int i = 0; i < (tune ? 0 : 4); i++) {
+			BenchImage input;
+			input.name = bundled[i];
+			try {
+				input.image.assign(bundled[i]);
+				images.push_back(input);
+			}
+			catch (CImgException& err) {
+				std::cerr << "Skipping " << bundled[i] << ": " << err.what() << std::endl;
+			}
+		}
+		for (size_t i = 0; i < (tune ? 0 : megapixels.size()); i++) {
+			int side = (int)sqrt(megapixels[i]*1e6);
+			for (size_t x = 0; x < distributions.size(); x++) {
+				for (int channels = 1; channels <= 3; channels += 2) {
+					BenchImage input;
+					stringstream name;
+					name << "synthetic_" << distributions[x] << "_" << megapixels[i] << "MP_" << channels << "ch";
+					input.name = name.str();
+					input.image = SyntheticImage(side, side, channels, 12345u + i, distributions[x]);
+					images.push_back(input);
+				}
+			}
+		}
+
+		ofstream csv;
+		if (!csv_file.empty() && !tune) {
+			csv.open(csv_file);
+			csv << "device,image,pixels,bins,compute_units,stage,median_us,p99_us,mpix_per_s" << std::endl;
+		}
+
+		std::cout << ListPlatformsDevices();
+		std::cout << "warmup " << warmup << ", iterations " << iterations << std::endl;
+
+		vector<cl::Platform> platforms;
+		cl::Platform::get(&platforms);
+		for (int p = 0; p < (int)platforms.size(); p++) {
+			if ((platform_only >= 0) && (p != platform_only))
+				continue;
+
+			vector<cl::Device> devices;
+			platforms[p].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+			for (int d = 0; d < (int)devices.size(); d++) {
+				if ((device_only >= 0) && (d != device_only))
+					continue;
+
+				string device_name = GetDeviceName(p, d);
+				std::cout << "\n=== " << GetPlatformName(p) << ", " << device_name << " ===" << std::endl;
+
+				if (tune) {
+					//start from the defaults, not from an earlier tuning
+					Tuning tuning(devices[d]);
+					for (size_t b = 0; b < bin_counts.size(); b++) {
+						EqualiserOptions options;
+						options.numBins = bin_counts[b];
+						options.profile = true;
+						options.verbose = false;
+						options.tuned = false;
+						Equaliser equaliser(p, d, options);
+
+						std::cout << bin_counts[b] << " bins:" << std::endl;
+						Autotune(equaliser, megapixels_set ? megapixels[0] : 4.0, warmup, iterations, tuning);
+					}
+					tuning.Save(device_name);
+					std::cout << "Saved to " << tuning.file_name << std::endl;
+					continue;
+				}
+
+				//one equaliser per bin count and compute unit limit, the rows of each limit show how the histogram scales
+				for (size_t b = 0; b < bin_counts.size(); b++) {
+					for (size_t u = 0; u < compute_units.size(); u++) {
+						EqualiserOptions options;
+						options.numBins = bin_counts[b];
+						options.computeUnits = compute_units[u];
+						options.profile = true;
+						options.verbose = false;
+						Equaliser equaliser(p, d, options);
+						//limits above what the device has are ignored, as in ConfigureHistogram
+						int units = (int)devices[d].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+						if (compute_units[u] > 0)
+							units = std::min(units, compute_units[u]);
+
+						std::cout << std::endl << left << setw(32) << "Image" << right << setw(8) << "Bins" << setw(6) << "CUs" << "  " << left << setw(36) << "Stage"
+							<< right << setw(12) << "Median[us]" << setw(12) << "p99[us]" << setw(12) << "MPix/s" << std::endl;
+
+						for (size_t i = 0; i < images.size(); i++) {
+							const CImg<unsigned char>& image = images[i].image;
+							double pixels = (double)image.width()*image.height()*image.depth();
+							double sampled_l1;
+							Samples samples = BenchImageOnDevice(equaliser, image, warmup, iterations, sample_error, clahe_tiles, sampled_l1);
+							float share = ModeShare(image);
+							std::cout << left << setw(32) << images[i].name << " mode share " << (int)(share*100.0f + 0.5f) << "%, pipeline histogram "
+								<< ((!equaliser.globalBins && (share >= options.skewThreshold)) ? "merges runs" : "plain atomics");
+							if (sampled_l1 >= 0.0)
+								std::cout << ", sampled histogram L1 error " << fixed << setprecision(4) << sampled_l1 << " (bound " << sample_error << ")";
+							std::cout << std::endl;
+
+							for (Samples::const_iterator stage = samples.begin(); stage != samples.end(); ++stage) {
+								double median = Percentile(stage->second, 50.0);
+								double p99 = Percentile(stage->second, 99.0);
+								double throughput = (median > 0) ? pixels/median : 0.0;
+
+								std::cout << left << setw(32) << images[i].name << right << setw(8) << bin_counts[b] << setw(6) << units << "  " << left << setw(36) << stage->first
+									<< right << fixed << setprecision(1) << setw(12) << median << setw(12) << p99 << setw(12) << throughput << std::endl;
+								if (csv.is_open())
+									csv << "\"" << device_name << "\"," << images[i].name << "," << pixels << "," << bin_counts[b] << "," << units << ",\"" << stage->first << "\""
+										<< "," << median << "," << p99 << "," << throughput << std::endl;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
+
+	return 0;
+}
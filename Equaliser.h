@@ -0,0 +1,1276 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+#include <future>
+#include <functional>
+#include <climits>
+
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+//settings shared by every image that goes through an Equaliser
+struct EqualiserOptions {
+	int numBins; //up to 65536, bins that do not fit in local memory are counted in global memory
+	int pixelBytes; //1 - 8-bit images, 2 - 16-bit images (the program is built for one pixel type)
+	int maxReplicas; //upper limit for local sub-histogram replication, reduced to what fits in local memory
+	int computeUnits; //0 - use all compute units of the device
+	int groupsPerUnit; //work-groups launched per compute unit by the histogram kernel
+	int histLocalSize; //0 - largest the histogram kernels and the device allow, up to 256
+	int greyLocalSize; //rgb2grey work-group size, 0 - left to the runtime
+	int projLocalSize; //back projection work-group size, 0 - left to the runtime
+	int projPixelsPerItem; //pixels each back projection work-item goes through
+	bool tuned; //take the launch parameters above from the device's tuning file when it has them (written by Bench -t / make tune)
+	float sampleError; //0 - exact histogram, otherwise bin a sample of the pixels with this expected L1 error (normalised)
+	float skewThreshold; //share of one intensity in a sample of the image above which the histogram merges runs (0 - always, > 1 - never)
+	ColourSpace colourSpace; //what colour images are equalised in, the program is built for one
+	int claheTiles; //0 - equalise the image as a whole, otherwise CLAHE over a grid of claheTiles x claheTiles tiles
+	float claheClip; //CLAHE clip limit, as a multiple of the mean bin count of a tile
+	bool specialise; //build the kernels for the bin count, channel count and layout instead of passing them as arguments
+	bool fuseLut; //build the LUT from the cumulative histogram in one kernel instead of normalise + scaled
+	bool fuseHistogram; //colour images: compute luminance inside the histogram kernel instead of running rgb2grey first
+	bool keepGrey; //also write the grey plane of colour images to the device (it is not needed for equalisation)
+	bool zeroCopy; //use host memory in place on devices that share it with the host, instead of copying
+	size_t hostBudget; //host memory [B] the tiled engine may use for its bands
+	int bandRows; //0 - tile only images that do not fit the device, with bands as large as the limits allow
+	bool debug; //read back and print every intermediate histogram (adds a host sync per stage)
+	bool profile; //record an event for every write, kernel and read
+	bool verbose;
+
+	EqualiserOptions() : numBins(256), pixelBytes(1), maxReplicas(8), computeUnits(0), groupsPerUnit(4), histLocalSize(0), greyLocalSize(0), projLocalSize(0), projPixelsPerItem(1), tuned(true), sampleError(0.0f), skewThreshold(0.25f), colourSpace(COLOUR_LUMA), claheTiles(0), claheClip(3.0f), specialise(true), fuseLut(true), fuseHistogram(true), keepGrey(false), zeroCopy(true), hostBudget(256 << 20), bandRows(0), debug(false), profile(false), verbose(true) {}
+};
+
+//prefix sum over a device buffer of any length: each work-group scans a block in local memory (scanLocal),
+//the block totals are scanned recursively and then added back into every block (scanAddBlockSums)
+struct Scanner {
+	cl::Context context;
+	cl::Kernel scanKernel;
+	cl::Kernel addKernel;
+	int localSize; //power of two, each work-group covers 2*localSize elements
+	vector<cl::Buffer> blockSums; //one buffer per recursion level
+	vector<int> blockSumsSize;
+	Profiler* profiler;
+
+	Scanner() : profiler(NULL) {}
+
+	void Init(const cl::Context& ctx, const cl::Program& program, const cl::Device& device) {
+		context = ctx;
+		scanKernel = cl::Kernel(program, "scanLocal");
+		addKernel = cl::Kernel(program, "scanAddBlockSums");
+
+		int maxWorkSize = std::min(scanKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), addKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		localSize = 1;
+		while ((localSize*2 <= 256) && (localSize*2 <= maxWorkSize))
+			localSize *= 2;
+	}
+
+	//scan the first n elements of data in place
+	void Run(const cl::CommandQueue& queue, const cl::Buffer& data, int n, bool inclusive, const vector<cl::Event>* wait = NULL, cl::Event* done = NULL, unsigned int level = 0) {
+		int blockSize = 2*localSize;
+		int blocks = (n + blockSize - 1)/blockSize;
+
+		if (level >= blockSums.size()) {
+			blockSums.resize(level + 1);
+			blockSumsSize.resize(level + 1, 0);
+		}
+		if (blocks > blockSumsSize[level]) {
+			blockSums[level] = cl::Buffer(context, CL_MEM_READ_WRITE, blocks*sizeof(int));
+			blockSumsSize[level] = blocks;
+		}
+
+		scanKernel.setArg(0, data);
+		scanKernel.setArg(1, data);
+		scanKernel.setArg(2, n);
+		scanKernel.setArg(3, blockSums[level]);
+		scanKernel.setArg(4, blockSize*sizeof(int), NULL);
+		scanKernel.setArg(5, inclusive ? 1 : 0);
+		vector<cl::Event> scanned(1);
+		queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(blocks*localSize), cl::NDRange(localSize), wait, &scanned[0]);
+		if (profiler)
+			profiler->Add("scanLocal", scanned[0], 2.0*n*sizeof(int));
+
+		if (blocks > 1) {
+			//block offsets are an exclusive scan of the block totals
+			vector<cl::Event> offsets(1);
+			Run(queue, blockSums[level], blocks, false, &scanned, &offsets[0], level + 1);
+
+			addKernel.setArg(0, data);
+			addKernel.setArg(1, n);
+			addKernel.setArg(2, blockSums[level]);
+			cl::Event added;
+			queue.enqueueNDRangeKernel(addKernel, cl::NullRange, cl::NDRange(blocks*localSize), cl::NDRange(localSize), &offsets, &added);
+			if (profiler)
+				profiler->Add("scanAddBlockSums", added, 2.0*n*sizeof(int));
+			if (done)
+				*done = added;
+		}
+		else if (done) {
+			*done = scanned[0];
+		}
+	}
+};
+
+//smallest power of two above the brightest pixel, used as the range of the histogram and the LUT
+int MaxValue(int maxPixel) {
+	int maxValue = 0;
+	for (int i=1; i<17; i++) {
+		if (int(pow(2.0, i)) > maxPixel) {
+			maxValue = pow(2.0, i);
+			break;
+		}
+	}
+	return maxValue;
+}
+
+//brightest luminance of a planar colour image, computed on the host the same way as the rgb2grey kernels
+template <typename T>
+int LumaMax(const CImg<T>& image) {
+	int numPixels = image.width()*image.height()*image.depth();
+	const T* R = image.data();
+	const T* G = R + numPixels;
+	const T* B = G + numPixels;
+	int maxPixel = 0;
+	for (int i = 0; i < numPixels; i++)
+		maxPixel = std::max(maxPixel, (int)(0.2126f*R[i] + 0.7152f*G[i] + 0.0722f*B[i]));
+	return maxPixel;
+}
+
+//brightest intensity the kernels will see in an image: luma for colour (V, the brightest channel, for HSV),
+//the pixel value for grey
+template <typename T>
+int IntensityMax(const CImg<T>& image, ColourSpace space) {
+	if (image.spectrum() < 3)
+		return (int)image.max();
+	if (space == COLOUR_HSV)
+		return (int)image.get_shared_channels(0, 2).max();
+	return LumaMax(image);
+}
+
+//share of the most common intensity among about `samples` pixels spread evenly over an image, intensity(i) giving
+//that of pixel i (luminance for colour). this is the share of the histogram atomics that would go to one counter
+float ModeShare(size_t numPixels, const std::function<int(size_t)>& intensity, int samples = 4096) {
+	if (numPixels == 0)
+		return 0.0f;
+	size_t step = std::max((size_t)1, numPixels/samples);
+	vector<int> values;
+	for (size_t i = step/2; i < numPixels; i += step)
+		values.push_back(intensity(i));
+
+	std::sort(values.begin(), values.end());
+	size_t longest = 0;
+	for (size_t i = 0, run = 0; i < values.size(); i++) {
+		run = ((i > 0) && (values[i] == values[i - 1])) ? run + 1 : 1;
+		longest = std::max(longest, run);
+	}
+	return (float)longest/values.size();
+}
+
+//the same for a planar CImg
+template <typename T>
+float ModeShare(const CImg<T>& image) {
+	size_t numPixels = (size_t)image.width()*image.height()*image.depth();
+	const T* data = image.data();
+	if (image.spectrum() >= 3)
+		return ModeShare(numPixels, [=](size_t i) { return (int)(0.2126f*data[i] + 0.7152f*data[numPixels + i] + 0.0722f*data[2*numPixels + i]); });
+	return ModeShare(numPixels, [=](size_t i) { return (int)data[i]; });
+}
+
+//per-channel statistics of a colour image (Equaliser::Histograms), numBins per histogram over [0, maxValue)
+struct ChannelHistograms {
+	int maxValue;
+	vector<int> histograms[4]; //R, G, B, luma
+	vector<int> luts[4]; //equalisation LUT of each histogram, when asked for
+
+	ChannelHistograms() : maxValue(0) {}
+};
+
+//a decoded input image, ready to be uploaded
+struct Frame {
+	size_t index;
+	string name;
+	CImg<unsigned char> image;
+	int maxValue;
+	float modeShare;
+	bool ok;
+
+	Frame() : index(0), maxValue(0), modeShare(0.0f), ok(false) {}
+};
+
+//load an image and find its value range and skew, runs on a host thread while the device works on earlier frames
+Frame DecodeFrame(size_t index, const string& name, ColourSpace space) {
+	Frame frame;
+	frame.index = index;
+	frame.name = name;
+	try {
+		frame.image.assign(name.c_str());
+		frame.maxValue = MaxValue(IntensityMax(frame.image, space));
+		frame.modeShare = ModeShare(frame.image);
+		frame.ok = true;
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << name << ": " << err.what() << std::endl;
+	}
+	return frame;
+}
+
+//source of row bands for the tiled engine: rows [y0, y0 + rows) of every channel, packed in the layout the engine
+//was given - planar (all the rows of the first channel, then all the rows of the second...) or interleaved.
+//returns where the band is: either the staging buffer it was copied into, or the source's own memory when the
+//band is already laid out there (it is uploaded from that pointer directly and has to stay valid for the run)
+typedef std::function<const unsigned char*(int y0, int rows, unsigned char* staging)> BandReader;
+//sink for the equalised bands, packed the same way and called in band order
+typedef std::function<void(int y0, int rows, const unsigned char* data)> BandWriter;
+
+//band adapters for a 2D CImg that is already in memory, bands are passed around as bytes whatever the pixel type
+template <typename T>
+BandReader ReadBands(const CImg<T>& image) {
+	return [&image](int y0, int rows, unsigned char* staging) -> const unsigned char* {
+		size_t band = (size_t)image.width()*rows*sizeof(T);
+		//a single plane is already contiguous
+		if (image.spectrum() == 1)
+			return (const unsigned char*)image.data(0, y0);
+		for (int c = 0; c < image.spectrum(); c++)
+			memcpy(staging + c*band, image.data(0, y0, 0, c), band);
+		return staging;
+	};
+}
+
+template <typename T>
+BandWriter WriteBands(CImg<T>& image) {
+	return [&image](int y0, int rows, const unsigned char* data) {
+		size_t band = (size_t)image.width()*rows*sizeof(T);
+		for (int c = 0; c < image.spectrum(); c++)
+			memcpy(image.data(0, y0, 0, c), data + c*band, band);
+	};
+}
+
+//one band of the tiled engine, double-buffered so the host reads the next band while the device works on this one.
+//the host side lives in pinned (mapped CL_MEM_ALLOC_HOST_PTR) staging buffers, which the device copies from directly
+struct Band {
+	cl::Buffer staging_input;
+	cl::Buffer staging_output;
+	unsigned char* host_input;
+	unsigned char* host_output;
+	cl::Buffer input;
+	cl::Buffer grey;
+	cl::Buffer output;
+	int y0;
+	int rows;
+	cl::Event done;
+	bool busy;
+
+	Band() : host_input(NULL), host_output(NULL), y0(0), rows(0), busy(false) {}
+};
+
+//the kernels that depend on the channel count and layout of an image, from a program specialised for them
+struct ColourKernels {
+	cl::Program program;
+	cl::Kernel rgb2grey;
+	cl::Kernel histogram;
+	cl::Kernel histogramRuns;
+	cl::Kernel backProjection;
+	cl::Kernel claheHistogram;
+	cl::Kernel claheApply;
+	cl::Kernel channelHistograms;
+};
+
+//device buffers of one frame in flight in the streaming pipeline
+struct StreamSlot {
+	Frame frame;
+	CImg<unsigned char> result;
+	cl::Buffer input;
+	cl::Buffer grey;
+	cl::Buffer output;
+	cl::Event downloaded;
+	bool busy;
+
+	StreamSlot() : busy(false) {}
+};
+
+//histogram equalisation engine - owns the OpenCL context, queue, program, kernels and device buffers
+//so that they are created once and reused for every image that goes through Run()
+struct Equaliser {
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue queue; //kernels
+	cl::CommandQueue upload_queue; //streaming mode host to device copies
+	cl::CommandQueue download_queue; //streaming mode device to host copies
+	cl::Program program; //specialised for the bin count and pixel type only, when options.specialise
+	map<pair<int, int>, ColourKernels> variants; //(channels, layout) -> kernels, built on first use
+
+	cl::Kernel histKernel;
+	cl::Kernel histRunsKernel; //for skewed images, see SetSkew
+	cl::Kernel reduceKernel;
+	Scanner scanner;
+	cl::Kernel normaliseKernel;
+	cl::Kernel scaledKernel;
+	cl::Kernel lutKernel;
+	cl::Kernel backProjGrey;
+	cl::Kernel claheLutKernel;
+	cl::Kernel reduceChannelsKernel;
+
+	//per-image buffers come from the pool and go back to it once the image is done
+	BufferPool pool;
+	Transfer transfer;
+	cl::Buffer dev_image_grey; //grey plane of the last colour image, only kept when WritesGrey
+	cl::Buffer partial_hist;
+	cl::Buffer hist_buffer;
+	cl::Buffer norm_buffer;
+	cl::Buffer scaledBuffer;
+	cl::Buffer tile_hist; //CLAHE histogram of every tile
+	cl::Buffer tile_luts; //CLAHE LUT of every tile
+	cl::Buffer channel_partials; //partial R, G, B and luma histograms of every work-group
+
+	EqualiserOptions options;
+	Profiler profiler;
+	int numBins;
+	bool verbose;
+
+	//histogram launch configuration, derived from the device
+	int histLocalSize;
+	int histMaxGroups;
+	int replicas;
+	bool globalBins; //the bins do not fit in local memory, every work-group counts into its partial histogram directly
+	bool mergeRuns; //the current image is skewed, its histogram merges runs of equal bins before the atomics
+	int sampleStride; //the histogram of the current image bins one pixel in this many, see SetSampling
+
+	//sizes of the buffers above that grow on demand
+	size_t tileBytes; //tile_hist and tile_luts
+	size_t channelPartialBytes; //channel_partials
+
+	Equaliser(int platform_id, int device_id, const EqualiserOptions& opts = EqualiserOptions())
+		: options(opts), numBins(opts.numBins), verbose(opts.verbose), globalBins(false), mergeRuns(false), sampleStride(1), tileBytes(0), channelPartialBytes(0) {
+		//3.1 Select computing devices
+		context = GetContext(platform_id, device_id);
+		device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		pool = BufferPool(context);
+		transfer = Transfer(device, options.zeroCopy);
+		if (verbose)
+			std::cout << "Transfers: " << transfer.Describe() << std::endl;
+
+		//create a queue to which we will push commands for the device, plus one for each copy direction so
+		//that transfers of neighbouring frames can overlap with the kernels when streaming
+		cl_command_queue_properties properties = options.profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+		queue = cl::CommandQueue(context, properties);
+		upload_queue = cl::CommandQueue(context, properties);
+		download_queue = cl::CommandQueue(context, properties);
+		profiler.enabled = options.profile;
+		profiler.print_events = options.profile && verbose;
+
+		//3.2 Load & build the device code, reusing a cached binary when the source and device are unchanged
+		bool cache_hit;
+		if ((options.pixelBytes != 1) && (options.pixelBytes != 2))
+			throw cl::Error(CL_INVALID_VALUE, "Equaliser: pixelBytes has to be 1 or 2");
+		program = BuildProgram(context, "kernels/my_kernels.cl", BuildOptions(0, LAYOUT_PLANAR), "kernels/cache", &cache_hit);
+		if (verbose)
+			std::cout << "Program " << (cache_hit ? "loaded from binary cache" : "built from source") << std::endl;
+
+		if (options.tuned)
+			ApplyTuning(Tuning(device));
+
+		reduceKernel = cl::Kernel(program, "reduceHistogram");
+		scanner.Init(context, program, device);
+		scanner.profiler = &profiler;
+		normaliseKernel = cl::Kernel(program, "normalise");
+		scaledKernel = cl::Kernel(program, "scaled");
+		lutKernel = cl::Kernel(program, "cdfToLut");
+		backProjGrey = cl::Kernel(program, "backProjection");
+		claheLutKernel = cl::Kernel(program, "claheLut");
+		reduceChannelsKernel = cl::Kernel(program, "reduceChannelHistograms");
+
+		ConfigureHistogram();
+
+		//histogram buffers only depend on the number of bins (and work-groups, see ConfigureHistogram)
+		hist_buffer = pool.Acquire(CL_MEM_READ_WRITE, numBins*sizeof(int));
+		norm_buffer = pool.Acquire(CL_MEM_READ_WRITE, numBins*sizeof(float));
+		scaledBuffer = pool.Acquire(CL_MEM_READ_WRITE, numBins*sizeof(int));
+	}
+
+	//size the histogram launch from the device: a few work-groups per compute unit, each with as many
+	//local sub-histogram replicas as fit in local memory. bins that do not fit at all (large bin counts of 16-bit
+	//images) are privatized per work-group in global memory instead, with one group per compute unit so that
+	//zeroing and reducing the partials stays small next to the counting.
+	//called again by the autotuner after it changes the options
+	void ConfigureHistogram(bool report = true) {
+		int computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		if ((options.computeUnits > 0) && (options.computeUnits < computeUnits))
+			computeUnits = options.computeUnits;
+
+		cl_ulong localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		globalBins = (numBins*sizeof(int) > localMemSize);
+		histKernel = cl::Kernel(program, globalBins ? "histogramGlobal" : "histogram");
+		histRunsKernel = cl::Kernel(program, "histogramRuns");
+		cl::Kernel histColourKernel(program, ColourHistogramKernelName());
+
+		int preferredWorkSize = histKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+		int kernelWorkSize = std::min(histKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+			histColourKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		kernelWorkSize = std::min(kernelWorkSize, (int)histRunsKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		histLocalSize = std::min((options.histLocalSize > 0) ? options.histLocalSize : 256, kernelWorkSize);
+		if (histLocalSize > preferredWorkSize)
+			histLocalSize -= histLocalSize % preferredWorkSize;
+		histMaxGroups = computeUnits*(globalBins ? 1 : options.groupsPerUnit);
+
+		replicas = 1;
+		while (!globalBins && (replicas*2 <= options.maxReplicas) && (replicas*2 <= histLocalSize) && (replicas*2*numBins*sizeof(int) <= localMemSize))
+			replicas *= 2;
+
+		//one partial histogram per work-group
+		pool.Release(partial_hist);
+		partial_hist = pool.Acquire(CL_MEM_READ_WRITE, histMaxGroups*numBins*sizeof(int));
+
+		if (!report)
+			return;
+		std::cout << "Histogram: " << computeUnits << " compute unit(s), " << histMaxGroups << " work-group(s) of "
+			<< histLocalSize << ", ";
+		if (globalBins)
+			std::cout << numBins << " bins in global memory" << std::endl;
+		else
+			std::cout << replicas << " local replica(s)" << std::endl;
+	}
+
+	//key of a kernel's entry in the tuning file: launch parameters depend on the pixel type, and for the
+	//histogram on the number of bins
+	string TuningKey(const string& kernel) const {
+		stringstream key;
+		key << kernel << "_";
+		if (kernel == "histogram")
+			key << numBins << "_";
+		key << options.pixelBytes;
+		return key.str();
+	}
+
+	//launch parameters from the tuning file, for the kernels it has entries for
+	void ApplyTuning(const Tuning& tuning) {
+		vector<int> values;
+		bool found = false;
+		if (tuning.Get(TuningKey("histogram"), values, 3)) {
+			options.histLocalSize = values[0];
+			options.groupsPerUnit = values[1];
+			options.maxReplicas = values[2];
+			found = true;
+		}
+		if (tuning.Get(TuningKey("rgb2grey"), values, 1)) {
+			options.greyLocalSize = values[0];
+			found = true;
+		}
+		if (tuning.Get(TuningKey("backprojection"), values, 2)) {
+			options.projLocalSize = values[0];
+			options.projPixelsPerItem = values[1];
+			found = true;
+		}
+		if (verbose)
+			std::cout << "Tuning: " << (found ? "loaded from " + tuning.file_name : string("none for this device, defaults")) << std::endl;
+	}
+
+	//-D defines of a program variant: the pixel type and colour space always, the bin count and (for channels > 0) the channel count
+	//and layout when specialising
+	string BuildOptions(int channels, PixelLayout layout) const {
+		stringstream defines;
+		if (options.pixelBytes == 2)
+			defines << "-DPIXEL=ushort ";
+		if (options.colourSpace != COLOUR_LUMA)
+			defines << "-DCOLOUR_SPACE=" << (int)options.colourSpace << " ";
+		if (options.specialise) {
+			defines << "-DNUM_BINS=" << numBins;
+			if (channels > 0)
+				defines << " -DCHANNELS=" << channels << " -DLAYOUT=" << (int)layout;
+		}
+		return defines.str();
+	}
+
+	const char* ColourHistogramKernelName() const {
+		return globalBins ? "rgb2greyHistogramGlobal" : "rgb2greyHistogram";
+	}
+
+	//kernels for images with this channel count and layout, the program variant is built (or loaded from the
+	//binary cache) the first time an image of that kind comes along
+	ColourKernels& Colour(int channels, PixelLayout layout) {
+		pair<int, int> key(options.specialise ? channels : 0, (int)layout);
+		map<pair<int, int>, ColourKernels>::iterator found = variants.find(key);
+		if (found != variants.end())
+			return found->second;
+
+		ColourKernels& kernels = variants[key];
+		if (options.specialise) {
+			bool cache_hit;
+			kernels.program = BuildProgram(context, "kernels/my_kernels.cl", BuildOptions(channels, layout), "kernels/cache", &cache_hit);
+			if (verbose)
+				std::cout << "Program variant " << channels << " channel(s), " << ((layout == LAYOUT_PLANAR) ? "planar" : "interleaved")
+					<< (cache_hit ? " loaded from binary cache" : " built from source") << std::endl;
+		}
+		else
+			kernels.program = program;
+		//CImg keeps its images planar, PNM files are interleaved
+		kernels.rgb2grey = cl::Kernel(kernels.program, RGB2GreyKernelName(layout));
+		kernels.histogram = cl::Kernel(kernels.program, ColourHistogramKernelName());
+		kernels.histogramRuns = cl::Kernel(kernels.program, "rgb2greyHistogramRuns");
+		kernels.backProjection = cl::Kernel(kernels.program, "backProjRGBA");
+		kernels.claheHistogram = cl::Kernel(kernels.program, "claheHistogram");
+		kernels.claheApply = cl::Kernel(kernels.program, "claheApply");
+		kernels.channelHistograms = cl::Kernel(kernels.program, "channelHistograms");
+		return kernels;
+	}
+
+	//swap the grey plane buffer for one of the right size when this image writes it
+	const cl::Buffer* GreyPlane(cl::Buffer& grey, int channels, int numPixels) {
+		pool.Release(grey);
+		if (!WritesGrey(channels))
+			return NULL;
+		grey = pool.Acquire(CL_MEM_READ_WRITE, (size_t)numPixels*options.pixelBytes);
+		return &grey;
+	}
+
+	//blocking read of a histogram-sized buffer for debug output, once the given stage has finished
+	template <typename T>
+	void Dump(const string& name, const cl::Buffer& buffer, const cl::Event& ready) {
+		vector<T> values(numBins);
+		vector<cl::Event> wait(1, ready);
+		queue.enqueueReadBuffer(buffer, CL_TRUE, 0, numBins*sizeof(T), &values[0], &wait);
+		std::cout << name << " = " << values << std::endl;
+	}
+
+	void EnqueueRGB2Grey(const cl::Buffer& input, const cl::Buffer& grey, int numPixels, int channels, const vector<cl::Event>* wait, cl::Event* done, PixelLayout layout = LAYOUT_PLANAR) {
+		cl::Kernel& kernel = Colour(channels, layout).rgb2grey;
+		kernel.setArg(0, input);
+		kernel.setArg(1, grey);
+		kernel.setArg(2, numPixels);
+		kernel.setArg(3, channels);
+
+		cl::Event converted;
+		size_t globalSize = RoundUp(RGB2GreyGlobalSize(layout, numPixels), options.greyLocalSize);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(globalSize), LocalRange(options.greyLocalSize), wait, &converted);
+		profiler.Add("rgb2grey", converted, (double)numPixels*(channels + 1)*options.pixelBytes, numPixels);
+		if (done)
+			*done = converted;
+	}
+
+	//pick the histogram kernels for the next image from the share of its most common intensity (ModeShare, sampled
+	//on the host): above options.skewThreshold the work-items merge runs of equal bins in registers, so that they
+	//do not all queue on one local counter. bins in global memory are left as they are
+	void SetSkew(float modeShare) {
+		mergeRuns = !globalBins && (modeShare >= options.skewThreshold);
+		if (verbose)
+			std::cout << "Skew: " << (int)(modeShare*100.0f + 0.5f) << "% of the sampled pixels share one value, "
+				<< (mergeRuns ? "merging runs" : "plain atomics") << std::endl;
+	}
+
+	//approximate histogram for the next image when options.sampleError is set: one pixel from every sampleStride is
+	//binned. the expected L1 error of a normalised histogram of n samples over B bins is at most sqrt(B/n), so
+	//B/e^2 samples are enough for an error of e whatever the image size. the LUT only sees the normalised
+	//cumulative histogram, so it needs nothing else. numPixels is the whole image, also when it goes in bands
+	void SetSampling(size_t numPixels, int channels) {
+		sampleStride = 1;
+		//the fused kernel only writes the grey plane for the pixels it bins
+		if (options.fuseHistogram && WritesGrey(channels))
+			return;
+		sampleStride = SampleStride(numPixels);
+		if (verbose && (options.sampleError > 0.0f))
+			std::cout << "Sampling: 1 in " << sampleStride << " pixel(s) binned" << std::endl;
+	}
+
+	//pixels per binned sample for options.sampleError over an image of numPixels, 1 for an exact histogram
+	int SampleStride(size_t numPixels) const {
+		if (options.sampleError <= 0.0f)
+			return 1;
+		double samples = numBins/((double)options.sampleError*options.sampleError);
+		return (int)std::max(1.0, floor(numPixels/samples));
+	}
+
+	//whether the grey plane of an image gets written to the device on its way to the histogram
+	bool WritesGrey(int channels) const {
+		return (channels >= 3) && (options.keepGrey || !options.fuseHistogram);
+	}
+
+	//profiling name of a histogram kernel, with the variant it ran as
+	string HistogramStageName(const string& kernel) const {
+		return kernel + (mergeRuns ? "Runs" : "") + ((sampleStride > 1) ? " (sampled)" : "");
+	}
+
+	//per-work-group partial histograms of the image on the device, returns the number of partials.
+	//colour images go through the fused rgb2greyHistogram unless fuseHistogram is off, grey is written when WritesGrey
+	int EnqueueHistogram(const cl::Buffer& input, int channels, int numPixels, int maxValue, const cl::Buffer* grey, const cl::Event& ready, cl::Event& done, PixelLayout layout = LAYOUT_PLANAR) {
+		vector<cl::Event> wait(1, ready);
+
+		//no more work-groups than there are pixels to go around, every group writes its own partial histogram
+		int histGroups = std::min(histMaxGroups, (numPixels + histLocalSize - 1)/histLocalSize);
+
+		if ((channels >= 3) && options.fuseHistogram) {
+			ColourKernels& kernels = Colour(channels, layout);
+			cl::Kernel& histColourKernel = mergeRuns ? kernels.histogramRuns : kernels.histogram;
+			histColourKernel.setArg(0, input);
+			histColourKernel.setArg(1, numPixels);
+			histColourKernel.setArg(2, channels);
+			histColourKernel.setArg(3, (int)layout);
+			histColourKernel.setArg(4, WritesGrey(channels) ? *grey : input); //not touched unless writeGrey
+			histColourKernel.setArg(5, (int)WritesGrey(channels));
+			histColourKernel.setArg(6, partial_hist);
+			histColourKernel.setArg(7, numBins);
+			histColourKernel.setArg(8, maxValue);
+			if (!globalBins) {
+				histColourKernel.setArg(9, replicas*numBins*sizeof(int), NULL);
+				histColourKernel.setArg(10, replicas);
+			}
+			histColourKernel.setArg(globalBins ? 9 : 11, sampleStride);
+
+			queue.enqueueNDRangeKernel(histColourKernel, cl::NullRange, cl::NDRange(histGroups*histLocalSize), cl::NDRange(histLocalSize), &wait, &done);
+			profiler.Add(HistogramStageName("rgb2greyHistogram"), done, (double)numPixels/sampleStride*(3 + (WritesGrey(channels) ? 1 : 0))*options.pixelBytes + (double)histGroups*numBins*sizeof(int), numPixels);
+			return histGroups;
+		}
+
+		const cl::Buffer* plane = &input;
+		if (channels >= 3) {
+			EnqueueRGB2Grey(input, *grey, numPixels, channels, &wait, &done, layout);
+			wait[0] = done;
+			plane = grey;
+		}
+
+		cl::Kernel& kernel = mergeRuns ? histRunsKernel : histKernel;
+		kernel.setArg(0, *plane);
+		kernel.setArg(1, numPixels);
+		kernel.setArg(2, partial_hist);
+		kernel.setArg(3, numBins);
+		kernel.setArg(4, maxValue);
+		if (!globalBins) {
+			kernel.setArg(5, replicas*numBins*sizeof(int), NULL);
+			kernel.setArg(6, replicas);
+		}
+		kernel.setArg(globalBins ? 5 : 7, sampleStride);
+
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(histGroups*histLocalSize), cl::NDRange(histLocalSize), &wait, &done);
+		profiler.Add(HistogramStageName("histogram"), done, (double)numPixels/sampleStride*options.pixelBytes + (double)histGroups*numBins*sizeof(int), numPixels);
+		return histGroups;
+	}
+
+	//histogram of an image (or one band of it) into hist_buffer, added to what is there already when accumulate is set
+	void EnqueueHistogramTotal(const cl::Buffer& input, int channels, int numPixels, int maxValue, bool accumulate, const cl::Event& ready, cl::Event& done, const cl::Buffer* grey = NULL, PixelLayout layout = LAYOUT_PLANAR) {
+		int histGroups = EnqueueHistogram(input, channels, numPixels, maxValue, grey, ready, done, layout);
+		vector<cl::Event> wait(1, done);
+
+		reduceKernel.setArg(0, partial_hist);
+		reduceKernel.setArg(1, histGroups);
+		reduceKernel.setArg(2, hist_buffer);
+		reduceKernel.setArg(3, numBins);
+		reduceKernel.setArg(4, (int)accumulate);
+
+		queue.enqueueNDRangeKernel(reduceKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange, &wait, &done);
+		profiler.Add("reduceHistogram", done, (histGroups + 1.0 + (accumulate ? 1 : 0))*numBins*sizeof(int));
+	}
+
+	//histogram -> cumulative histogram -> LUT (scaledBuffer) for an image that is already on the device.
+	//the whole chain stays on the device, every stage waits on the event of the stage before it.
+	//grey is only needed (and written) when WritesGrey(channels)
+	void EnqueueLut(const cl::Buffer& input, int channels, int numPixels, int maxValue, const cl::Event& ready, cl::Event& done, const cl::Buffer* grey = NULL) {
+		EnqueueHistogramTotal(input, channels, numPixels, maxValue, false, ready, done, grey);
+		EnqueueLutFromHistogram(maxValue, done, done);
+	}
+
+	//cumulative histogram -> LUT (scaledBuffer) from the histogram in hist_buffer
+	void EnqueueLutFromHistogram(int maxValue, const cl::Event& ready, cl::Event& done) {
+		vector<cl::Event> wait(1, ready);
+		if (options.debug)
+			Dump<int>("Original Hist", hist_buffer, ready);
+
+		//inclusive scan, so the last bin of the cumulative histogram holds the pixel count
+		scanner.Run(queue, hist_buffer, numBins, true, &wait, &done);
+		wait[0] = done;
+		if (options.debug)
+			Dump<int>("Scan Hist", hist_buffer, done);
+
+		if (options.fuseLut) {
+			//normalise and scale the cumulative histogram in one kernel
+			lutKernel.setArg(0, hist_buffer);
+			lutKernel.setArg(1, scaledBuffer);
+			lutKernel.setArg(2, numBins);
+			lutKernel.setArg(3, maxValue);
+
+			queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange, &wait, &done);
+			profiler.Add("cdfToLut", done, 2.0*numBins*sizeof(int));
+		}
+		else {
+			normaliseKernel.setArg(0, hist_buffer);
+			normaliseKernel.setArg(1, norm_buffer);
+			normaliseKernel.setArg(2, numBins);
+
+			queue.enqueueNDRangeKernel(normaliseKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange, &wait, &done);
+			profiler.Add("normalise", done, 2.0*numBins*sizeof(int));
+			wait[0] = done;
+			if (options.debug)
+				Dump<float>("Float Hist", norm_buffer, done);
+
+			scaledKernel.setArg(0, norm_buffer);
+			scaledKernel.setArg(1, scaledBuffer);
+			scaledKernel.setArg(2, numBins);
+			scaledKernel.setArg(3, maxValue);
+
+			queue.enqueueNDRangeKernel(scaledKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange, &wait, &done);
+			profiler.Add("scaled", done, 2.0*numBins*sizeof(int));
+		}
+		if (options.debug)
+			Dump<int>("Scaled Hist", scaledBuffer, done);
+	}
+
+	//apply the LUT to the grey plane (1 channel) or to the colour image (3/4 channels), keeping its layout
+	void EnqueueBackProjection(const cl::Buffer& input, const cl::Buffer& output, int channels, int numPixels, int maxValue, const vector<cl::Event>* wait, cl::Event* done, PixelLayout layout = LAYOUT_PLANAR) {
+		int pixelsPerItem = std::max(1, options.projPixelsPerItem);
+		cl::NDRange globalSize(RoundUp((numPixels + pixelsPerItem - 1)/pixelsPerItem, options.projLocalSize));
+		cl::Event projected;
+		if (channels < 3) { //differing projections for greyscale, rgb, rgba
+			backProjGrey.setArg(0, input);
+			backProjGrey.setArg(1, output);
+			backProjGrey.setArg(2, scaledBuffer);
+			backProjGrey.setArg(3, numBins);
+			backProjGrey.setArg(4, maxValue);
+			backProjGrey.setArg(5, numPixels);
+
+			queue.enqueueNDRangeKernel(backProjGrey, cl::NullRange, globalSize, LocalRange(options.projLocalSize), wait, &projected);
+			profiler.Add("backProjection", projected, 2.0*numPixels*options.pixelBytes, numPixels);
+		}
+		else {
+			cl::Kernel& backProjColour = Colour(channels, layout).backProjection;
+			backProjColour.setArg(0, input);
+			backProjColour.setArg(1, output);
+			backProjColour.setArg(2, scaledBuffer);
+			backProjColour.setArg(3, maxValue);
+			backProjColour.setArg(4, channels);
+			backProjColour.setArg(5, numBins);
+			backProjColour.setArg(6, numPixels);
+			backProjColour.setArg(7, (int)layout);
+
+			queue.enqueueNDRangeKernel(backProjColour, cl::NullRange, globalSize, LocalRange(options.projLocalSize), wait, &projected);
+			profiler.Add("backProjRGBA", projected, 2.0*numPixels*channels*options.pixelBytes, numPixels);
+		}
+		if (done)
+			*done = projected;
+	}
+
+	//work-group size for a launch of a kernel sized like the histogram ones: histLocalSize, capped to what the kernel
+	//itself can run with on the device, as its register and local memory use differ from the histogram kernels'
+	int KernelLocalSize(const cl::Kernel& kernel) const {
+		return std::min(histLocalSize, (int)kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	}
+
+	//CLAHE of an image on the device, in three launches that never leave it: the histograms of all tiles (one
+	//work-group per tile), the clipped LUT of every tile, then the back projection interpolating between the LUTs
+	//of the nearest tiles. the tile histograms live in local memory, so the bins have to fit there
+	void EnqueueClahe(const cl::Buffer& input, const cl::Buffer& output, int width, int height, int channels, int maxValue, const cl::Event& ready, cl::Event& done, PixelLayout layout = LAYOUT_PLANAR) {
+		if (globalBins)
+			throw cl::Error(CL_INVALID_VALUE, "EnqueueClahe: CLAHE needs the histogram bins to fit in local memory");
+		int numPixels = width*height;
+		int tileWidth = (width + options.claheTiles - 1)/options.claheTiles;
+		int tileHeight = (height + options.claheTiles - 1)/options.claheTiles;
+		//no empty tiles at the right and bottom edges
+		int tilesX = (width + tileWidth - 1)/tileWidth;
+		int tilesY = (height + tileHeight - 1)/tileHeight;
+		int numTiles = tilesX*tilesY;
+		int clipLimit = std::max(1, (int)(options.claheClip*tileWidth*tileHeight/numBins));
+
+		size_t bytes = (size_t)numTiles*numBins*sizeof(int);
+		if (bytes > tileBytes) {
+			pool.Release(tile_hist);
+			pool.Release(tile_luts);
+			tile_hist = pool.Acquire(CL_MEM_READ_WRITE, bytes);
+			tile_luts = pool.Acquire(CL_MEM_READ_WRITE, bytes);
+			tileBytes = bytes;
+		}
+
+		ColourKernels& kernels = Colour(channels, layout);
+		vector<cl::Event> wait(1, ready);
+
+		cl::Kernel& histogram = kernels.claheHistogram;
+		int histogramLocalSize = KernelLocalSize(histogram);
+		histogram.setArg(0, input);
+		histogram.setArg(1, width);
+		histogram.setArg(2, height);
+		histogram.setArg(3, channels);
+		histogram.setArg(4, (int)layout);
+		histogram.setArg(5, tilesX);
+		histogram.setArg(6, tileWidth);
+		histogram.setArg(7, tileHeight);
+		histogram.setArg(8, tile_hist);
+		histogram.setArg(9, numBins);
+		histogram.setArg(10, maxValue);
+		histogram.setArg(11, numBins*sizeof(int), NULL);
+
+		queue.enqueueNDRangeKernel(histogram, cl::NullRange, cl::NDRange(numTiles*histogramLocalSize), cl::NDRange(histogramLocalSize), &wait, &done);
+		profiler.Add("claheHistogram", done, (double)numPixels*((channels >= 3) ? 3 : 1)*options.pixelBytes + (double)bytes, numPixels);
+		wait[0] = done;
+
+		claheLutKernel.setArg(0, tile_hist);
+		claheLutKernel.setArg(1, tile_luts);
+		claheLutKernel.setArg(2, numBins);
+		claheLutKernel.setArg(3, maxValue);
+		claheLutKernel.setArg(4, clipLimit);
+		int lutLocalSize = KernelLocalSize(claheLutKernel);
+		claheLutKernel.setArg(5, numBins*sizeof(int), NULL);
+		claheLutKernel.setArg(6, lutLocalSize*sizeof(int), NULL);
+
+		queue.enqueueNDRangeKernel(claheLutKernel, cl::NullRange, cl::NDRange(numTiles*lutLocalSize), cl::NDRange(lutLocalSize), &wait, &done);
+		profiler.Add("claheLut", done, 2.0*bytes);
+		wait[0] = done;
+		if (options.debug)
+			Dump<int>("Tile 0 LUT", tile_luts, done);
+
+		cl::Kernel& apply = kernels.claheApply;
+		apply.setArg(0, input);
+		apply.setArg(1, output);
+		apply.setArg(2, tile_luts);
+		apply.setArg(3, width);
+		apply.setArg(4, height);
+		apply.setArg(5, channels);
+		apply.setArg(6, (int)layout);
+		apply.setArg(7, tilesX);
+		apply.setArg(8, tilesY);
+		apply.setArg(9, tileWidth);
+		apply.setArg(10, tileHeight);
+		apply.setArg(11, numBins);
+		apply.setArg(12, maxValue);
+
+		int output_channels = (channels >= 3) ? channels : 1;
+		int pixelsPerItem = std::max(1, options.projPixelsPerItem);
+		cl::NDRange globalSize(RoundUp((numPixels + pixelsPerItem - 1)/pixelsPerItem, options.projLocalSize));
+		queue.enqueueNDRangeKernel(apply, cl::NullRange, globalSize, LocalRange(options.projLocalSize), &wait, &done);
+		profiler.Add("claheApply", done, (double)numPixels*(((channels >= 3) ? 3 : 1) + output_channels)*options.pixelBytes, numPixels);
+	}
+
+	//equalise an image that is on the device from input to output: one LUT for the whole image, or CLAHE when
+	//options.claheTiles is set. grey as for EnqueueLut
+	void EnqueueEqualise(const cl::Buffer& input, const cl::Buffer& output, int width, int height, int channels, int maxValue, const cl::Event& ready, cl::Event& done, const cl::Buffer* grey = NULL) {
+		if (options.claheTiles > 0) {
+			EnqueueClahe(input, output, width, height, channels, maxValue, ready, done);
+			return;
+		}
+		cl::Event lut;
+		EnqueueLut(input, channels, width*height, maxValue, ready, lut, grey);
+
+		vector<cl::Event> wait(1, lut);
+		EnqueueBackProjection(input, output, (channels >= 3) ? channels : 1, width*height, maxValue, &wait, &done);
+	}
+
+	//whether the four local histograms of channelHistograms fit in the local memory of the device together. unlike the
+	//luma histogram they are never replicated or moved to global memory, see ConfigureHistogram
+	bool ChannelHistogramsFit() const {
+		return 4*numBins*sizeof(int) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	}
+
+	//R, G, B and luma histograms of a colour image on the device, numBins each and in that order in histograms, from
+	//one read of every pixel instead of one pass per plane. with luts set the equalisation LUT of each histogram is
+	//built next to it (claheLut without a clip limit). sampled like the other histograms, see SetSampling
+	void EnqueueChannelHistograms(const cl::Buffer& input, int channels, int numPixels, int maxValue, const cl::Buffer& histograms, const cl::Buffer* luts, const cl::Event& ready, cl::Event& done, PixelLayout layout = LAYOUT_PLANAR) {
+		if (channels < 3)
+			throw cl::Error(CL_INVALID_VALUE, "EnqueueChannelHistograms: the image has to be in colour");
+		if (!ChannelHistogramsFit())
+			throw cl::Error(CL_INVALID_VALUE, "EnqueueChannelHistograms: four histograms of numBins have to fit in local memory");
+
+		//both kernels run at the histogram work-group size as far as their own limits allow
+		cl::Kernel& kernel = Colour(channels, layout).channelHistograms;
+		int localSize = KernelLocalSize(kernel);
+		int lutLocalSize = KernelLocalSize(claheLutKernel);
+		//claheLut scans in local memory: the cdf, one total per work-item and the excess
+		if (luts && ((numBins + lutLocalSize + 1)*sizeof(int) > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()))
+			throw cl::Error(CL_INVALID_VALUE, "EnqueueChannelHistograms: the LUTs of numBins do not fit in local memory");
+
+		int histGroups = std::min(histMaxGroups, (numPixels + localSize - 1)/localSize);
+		size_t bytes = (size_t)histGroups*4*numBins*sizeof(int);
+		if (bytes > channelPartialBytes) {
+			pool.Release(channel_partials);
+			channel_partials = pool.Acquire(CL_MEM_READ_WRITE, bytes);
+			channelPartialBytes = bytes;
+		}
+
+		vector<cl::Event> wait(1, ready);
+		kernel.setArg(0, input);
+		kernel.setArg(1, numPixels);
+		kernel.setArg(2, channels);
+		kernel.setArg(3, (int)layout);
+		kernel.setArg(4, channel_partials);
+		kernel.setArg(5, numBins);
+		kernel.setArg(6, maxValue);
+		kernel.setArg(7, 4*numBins*sizeof(int), NULL);
+		kernel.setArg(8, sampleStride);
+
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(histGroups*localSize), cl::NDRange(localSize), &wait, &done);
+		profiler.Add((sampleStride > 1) ? "channelHistograms (sampled)" : "channelHistograms", done, (double)numPixels/sampleStride*3*options.pixelBytes + (double)bytes, numPixels);
+		wait[0] = done;
+
+		reduceChannelsKernel.setArg(0, channel_partials);
+		reduceChannelsKernel.setArg(1, histGroups);
+		reduceChannelsKernel.setArg(2, histograms);
+		reduceChannelsKernel.setArg(3, numBins);
+
+		queue.enqueueNDRangeKernel(reduceChannelsKernel, cl::NullRange, cl::NDRange(4*numBins), cl::NullRange, &wait, &done);
+		profiler.Add("reduceChannelHistograms", done, (histGroups + 1.0)*4*numBins*sizeof(int));
+		if (!luts)
+			return;
+		wait[0] = done;
+
+		claheLutKernel.setArg(0, histograms);
+		claheLutKernel.setArg(1, *luts);
+		claheLutKernel.setArg(2, numBins);
+		claheLutKernel.setArg(3, maxValue);
+		claheLutKernel.setArg(4, INT_MAX);
+		claheLutKernel.setArg(5, numBins*sizeof(int), NULL);
+		claheLutKernel.setArg(6, lutLocalSize*sizeof(int), NULL);
+
+		queue.enqueueNDRangeKernel(claheLutKernel, cl::NullRange, cl::NDRange(4*lutLocalSize), cl::NDRange(lutLocalSize), &wait, &done);
+		profiler.Add("channelLuts", done, 2.0*4*numBins*sizeof(int));
+	}
+
+	//per-channel statistics of a colour image: its R, G, B and luma histograms, plus the equalisation LUT of each
+	//when luts is set, all from one pass over the pixels. the range is that of the brightest channel
+	template <typename T>
+	ChannelHistograms Histograms(const CImg<T>& image, bool luts = false) {
+		if (sizeof(T) != (size_t)options.pixelBytes)
+			throw cl::Error(CL_INVALID_VALUE, "Histograms: pixel type does not match options.pixelBytes");
+		int channels = image.spectrum();
+		if (channels < 3)
+			throw cl::Error(CL_INVALID_VALUE, "Histograms: the image has to be in colour");
+		int numPixels = image.width()*image.height()*image.depth();
+		size_t input_bytes = image.size()*sizeof(T);
+		size_t bytes = 4*numBins*sizeof(int);
+
+		ChannelHistograms result;
+		result.maxValue = MaxValue((int)image.get_shared_channels(0, 2).max());
+
+		cl::Buffer input = transfer.Bind(pool, CL_MEM_READ_ONLY, image.data(), input_bytes);
+		cl::Buffer histograms = pool.Acquire(CL_MEM_READ_WRITE, bytes);
+		cl::Buffer lut_buffer;
+		if (luts)
+			lut_buffer = pool.Acquire(CL_MEM_READ_WRITE, bytes);
+
+		cl::Event written;
+		transfer.Upload(queue, input, image.data(), input_bytes, written);
+		profiler.Add("write input", written, input_bytes);
+
+		//channelHistograms writes no grey plane, so unlike SetSampling nothing stops it sampling
+		sampleStride = SampleStride(numPixels);
+		cl::Event done;
+		EnqueueChannelHistograms(input, channels, numPixels, result.maxValue, histograms, luts ? &lut_buffer : NULL, written, done);
+
+		vector<cl::Event> wait(1, done);
+		vector<int> values(4*numBins);
+		queue.enqueueReadBuffer(histograms, CL_TRUE, 0, bytes, &values[0], &wait);
+		for (int c = 0; c < 4; c++)
+			result.histograms[c].assign(values.begin() + c*numBins, values.begin() + (c + 1)*numBins);
+		if (luts) {
+			queue.enqueueReadBuffer(lut_buffer, CL_TRUE, 0, bytes, &values[0], &wait);
+			for (int c = 0; c < 4; c++)
+				result.luts[c].assign(values.begin() + c*numBins, values.begin() + (c + 1)*numBins);
+		}
+
+		pool.Release(input);
+		pool.Release(histograms);
+		pool.Release(lut_buffer);
+		profiler.Collect(profiler.frame++);
+		return result;
+	}
+
+	//rows per band of the tiled engine: a band has to fit in one device allocation, the four band buffers (input and
+	//output, double-buffered) in half of the device memory and the host copies of them in hostBudget. this only sizes
+	//the bands, whether an image is tiled at all is up to NeedsTiling
+	int BandRows(int width, int channels) {
+		size_t rowBytes = (size_t)width*channels*options.pixelBytes;
+		size_t limit = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		limit = std::min(limit, (size_t)device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()/8);
+		limit = std::min(limit, options.hostBudget/4);
+		//pixel counts are ints on the device
+		limit = std::min(limit, (size_t)(1u << 30));
+		int rows = (int)std::max((size_t)1, limit/rowBytes);
+		if (options.bandRows > 0)
+			rows = std::min(rows, options.bandRows);
+		return rows;
+	}
+
+	//whether an image has to go through the tiled engine: when options.bandRows asks for it (not with CLAHE, which
+	//needs the whole image and always gets it when it fits), or when the image does not
+	//fit the device in one piece - input or output over the allocation limit, input, output and grey plane together
+	//over the global memory, or more samples than the int indices of the kernels reach. the host budget plays no
+	//part, an image that is in host memory already needs no staging
+	bool NeedsTiling(int width, int height, int channels) {
+		if ((options.bandRows > 0) && (options.claheTiles == 0))
+			return true;
+		size_t numPixels = (size_t)width*height;
+		size_t inputBytes = numPixels*channels*options.pixelBytes;
+		size_t outputBytes = numPixels*((channels >= 3) ? channels : 1)*options.pixelBytes;
+		size_t greyBytes = numPixels*options.pixelBytes;
+		size_t allocLimit = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		return (inputBytes > allocLimit) || (outputBytes > allocLimit)
+			|| (inputBytes + outputBytes + greyBytes > (size_t)device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>())
+			|| (numPixels*channels > (size_t)INT_MAX);
+	}
+
+	//get the band's rows from the reader onto the device. bands copied into the pinned staging buffer are uploaded
+	//from there, bands the reader already has in memory (a mapped file) go through Transfer straight from that
+	//memory - used in place on devices that share host memory, one copy otherwise
+	void UploadBand(const BandReader& read, Band& band, int width, int channels, cl::Event& uploaded) {
+		size_t bytes = (size_t)width*band.rows*channels*options.pixelBytes;
+		const unsigned char* source = read(band.y0, band.rows, band.host_input);
+
+		pool.Release(band.input);
+		if (source == band.host_input) {
+			band.input = pool.Acquire(CL_MEM_READ_ONLY, bytes);
+			upload_queue.enqueueWriteBuffer(band.input, CL_FALSE, 0, bytes, source, NULL, &uploaded);
+		}
+		else {
+			band.input = transfer.Bind(pool, CL_MEM_READ_ONLY, source, bytes);
+			transfer.Upload(upload_queue, band.input, source, bytes, uploaded);
+		}
+		profiler.Add("write band", uploaded, (double)bytes);
+	}
+
+	//two-pass equalisation of an image that never has to be resident on the device or the host as a whole:
+	//the first pass streams the bands through the histogram, accumulating it in hist_buffer, the second
+	//streams them again through the back projection. maxValue has to be known up front - the full range of
+	//the pixel type when the source cannot be scanned in advance. the bands hold options.pixelBytes per sample
+	void RunTiled(int width, int height, int channels, int maxValue, const BandReader& read, const BandWriter& write, PixelLayout layout = LAYOUT_PLANAR) {
+		if (options.claheTiles > 0)
+			throw cl::Error(CL_INVALID_VALUE, NeedsTiling(width, height, channels)
+				? "RunTiled: CLAHE needs the whole image on the device, and this one exceeds the device's allocation or memory limits"
+				: "RunTiled: CLAHE needs the whole image on the device, it cannot be streamed in bands");
+		int rows = BandRows(width, channels);
+		int numBands = (height + rows - 1)/rows;
+		int output_channels = (channels >= 3) ? channels : 1;
+		size_t planeBytes = (size_t)width*rows*options.pixelBytes; //one channel of a band
+
+		if (verbose)
+			std::cout << "Tiled: " << numBands << " band(s) of " << rows << " row(s)" << std::endl;
+		SetSampling((size_t)width*height, channels);
+
+		Band bands[2];
+		for (int b = 0; b < 2; b++) {
+			bands[b].staging_input = pool.Acquire(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, planeBytes*channels);
+			bands[b].staging_output = pool.Acquire(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, planeBytes*output_channels);
+			bands[b].host_input = (unsigned char*)queue.enqueueMapBuffer(bands[b].staging_input, CL_TRUE, CL_MAP_WRITE, 0, planeBytes*channels);
+			bands[b].host_output = (unsigned char*)queue.enqueueMapBuffer(bands[b].staging_output, CL_TRUE, CL_MAP_READ, 0, planeBytes*output_channels);
+			bands[b].output = pool.Acquire(CL_MEM_WRITE_ONLY, planeBytes*output_channels);
+		}
+
+		//pass 1: histogram of every band, added up on the device
+		cl::Event counted;
+		for (int k = 0; k < numBands; k++) {
+			Band& band = bands[k % 2];
+			if (band.busy)
+				band.done.wait();
+			band.y0 = k*rows;
+			band.rows = std::min(rows, height - band.y0);
+			int numPixels = width*band.rows;
+
+			cl::Event uploaded;
+			UploadBand(read, band, width, channels, uploaded);
+
+			const cl::Buffer* grey = GreyPlane(band.grey, channels, numPixels);
+			EnqueueHistogramTotal(band.input, channels, numPixels, maxValue, k > 0, uploaded, band.done, grey, layout);
+			counted = band.done;
+			band.busy = true;
+
+			upload_queue.flush();
+			queue.flush();
+		}
+
+		cl::Event lut;
+		EnqueueLutFromHistogram(maxValue, counted, lut);
+		lut.wait();
+		bands[0].busy = bands[1].busy = false;
+
+		//pass 2: the same bands again through the LUT, written out in order as they come back
+		for (int k = 0; k < numBands + 2; k++) {
+			Band& band = bands[k % 2];
+			if (band.busy) {
+				band.done.wait();
+				write(band.y0, band.rows, band.host_output);
+				band.busy = false;
+			}
+			if (k >= numBands)
+				continue;
+
+			band.y0 = k*rows;
+			band.rows = std::min(rows, height - band.y0);
+			int numPixels = width*band.rows;
+
+			vector<cl::Event> wait(2);
+			wait[0] = lut;
+			UploadBand(read, band, width, channels, wait[1]);
+
+			cl::Event projected;
+			EnqueueBackProjection(band.input, band.output, output_channels, numPixels, maxValue, &wait, &projected, layout);
+
+			vector<cl::Event> ready(1, projected);
+			size_t bytes = (size_t)numPixels*output_channels*options.pixelBytes;
+			download_queue.enqueueReadBuffer(band.output, CL_FALSE, 0, bytes, band.host_output, &ready, &band.done);
+			profiler.Add("read band", band.done, (double)bytes);
+			band.busy = true;
+
+			upload_queue.flush();
+			queue.flush();
+			download_queue.flush();
+		}
+
+		for (int b = 0; b < 2; b++) {
+			queue.enqueueUnmapMemObject(bands[b].staging_input, bands[b].host_input);
+			queue.enqueueUnmapMemObject(bands[b].staging_output, bands[b].host_output);
+			pool.Release(bands[b].staging_input);
+			pool.Release(bands[b].staging_output);
+			pool.Release(bands[b].input);
+			pool.Release(bands[b].grey);
+			pool.Release(bands[b].output);
+		}
+		profiler.Collect(profiler.frame++);
+	}
+
+	//equalise a single image and return the result.
+	//the input is uploaded once and everything up to the equalised image stays on the device: the histogram
+	//(fused with rgb2grey for colour) and the back projection both read the input buffer. with zero-copy the
+	//input and output buffers are the CImg memory itself when it is aligned well enough.
+	//only images that exceed the device's allocation or memory limits go through the tiled engine instead (see
+	//NeedsTiling), not with CLAHE.
+	//T is unsigned char or unsigned short, matching options.pixelBytes
+	template <typename T>
+	CImg<T> Run(const CImg<T>& image_input) {
+		if (sizeof(T) != (size_t)options.pixelBytes)
+			throw cl::Error(CL_INVALID_VALUE, "Run: pixel type does not match options.pixelBytes");
+		int channels = image_input.spectrum();
+		int numPixels = image_input.width()*image_input.height()*image_input.depth();
+		string colour_name = (channels >= 3) ? ((channels == 4) ? "RGBA" : "RGB") : "Grey";
+
+		int output_channels = (channels >= 3) ? channels : 1;
+
+		if ((image_input.depth() == 1) && NeedsTiling(image_input.width(), image_input.height(), channels)) {
+			CImg<T> output_image(image_input.width(), image_input.height(), 1, output_channels);
+			SetSkew(ModeShare(image_input));
+			int maxPixel = IntensityMax(image_input, options.colourSpace);
+			RunTiled(image_input.width(), image_input.height(), channels, MaxValue(maxPixel), ReadBands(image_input), WriteBands(output_image));
+			return output_image;
+		}
+
+		CImg<T> output_image(image_input.width(), image_input.height(), image_input.depth(), output_channels);
+		size_t input_bytes = image_input.size()*sizeof(T);
+		size_t output_bytes = output_image.size()*sizeof(T);
+
+		const cl::Buffer* grey = GreyPlane(dev_image_grey, channels, numPixels);
+		cl::Buffer input = transfer.Bind(pool, CL_MEM_READ_ONLY, image_input.data(), input_bytes);
+		cl::Buffer output = transfer.Bind(pool, CL_MEM_WRITE_ONLY, output_image.data(), output_bytes);
+
+		if (verbose) {
+			std::cout << "Image Size: " << input_bytes << " bytes" << std::endl;
+			std::cout << channels << std::endl;
+		}
+
+		cl::Event written;
+		transfer.Upload(queue, input, image_input.data(), input_bytes, written);
+		profiler.Add("write input", written, input_bytes);
+
+		//the range and skew are found on the host while the upload is in flight, instead of reading the grey plane back
+		int maxPixel = IntensityMax(image_input, options.colourSpace);
+		int maxValue = MaxValue(maxPixel);
+		SetSkew(ModeShare(image_input));
+		SetSampling(numPixels, channels);
+
+		if (verbose) {
+			std::cout << colour_name << std::endl;
+			std::cout << maxPixel << std::endl;
+			std::cout << maxValue << std::endl;
+			std::cout << numBins << std::endl;
+		}
+
+		//depth slices are stacked as rows
+		cl::Event done;
+		EnqueueEqualise(input, output, image_input.width(), image_input.height()*image_input.depth(), channels, maxValue, written, done, grey);
+
+		//the only host sync of the chain
+		vector<cl::Event> projected(1, done);
+		cl::Event read;
+		transfer.Download(queue, output, output_image.data(), output_bytes, &projected, read, true);
+		profiler.Add("read output", read, output_bytes);
+
+		pool.Release(input);
+		pool.Release(output);
+		profiler.Collect(profiler.frame++);
+		return output_image;
+	}
+
+	//wait for the oldest frame of a slot to come back and hand it to the consumer
+	void Retire(StreamSlot& slot, const std::function<void(const Frame&, const CImg<unsigned char>&)>& consume) {
+		slot.downloaded.wait();
+		pool.Release(slot.input);
+		pool.Release(slot.grey);
+		pool.Release(slot.output);
+		profiler.Collect(slot.frame.index);
+		consume(slot.frame, slot.result);
+		slot.busy = false;
+	}
+
+	//pipelined equalisation of a sequence of images: the next file is decoded on a host thread, and with three
+	//slots of device buffers frame N+1 uploads (upload_queue) while frame N is equalised (queue) and frame
+	//N-1 downloads (download_queue). results are handed to consume in input order. 8-bit images only
+	void Stream(const vector<string>& files, const std::function<void(const Frame&, const CImg<unsigned char>&)>& consume) {
+		const int numSlots = 3;
+		StreamSlot slots[numSlots];
+		size_t submitted = 0;
+
+		if (files.empty())
+			return;
+		if (options.pixelBytes != 1)
+			throw cl::Error(CL_INVALID_VALUE, "Stream: only 8-bit images can be streamed");
+
+		std::future<Frame> next = std::async(std::launch::async, DecodeFrame, (size_t)0, files[0], options.colourSpace);
+
+		for (size_t i = 0; i < files.size(); i++) {
+			Frame frame = next.get();
+			if (i + 1 < files.size())
+				next = std::async(std::launch::async, DecodeFrame, i + 1, files[i + 1], options.colourSpace);
+			if (!frame.ok)
+				continue;
+
+			//the slot is free again once the frame submitted three steps ago has been downloaded
+			StreamSlot& slot = slots[submitted % numSlots];
+			if (slot.busy)
+				Retire(slot, consume);
+
+			slot.frame = std::move(frame);
+			const CImg<unsigned char>& image = slot.frame.image;
+			int channels = image.spectrum();
+			int numPixels = image.width()*image.height()*image.depth();
+			int output_channels = (channels >= 3) ? channels : 1;
+
+			slot.result.assign(image.width(), image.height(), image.depth(), output_channels);
+			slot.input = transfer.Bind(pool, CL_MEM_READ_ONLY, image.data(), image.size());
+			slot.output = transfer.Bind(pool, CL_MEM_WRITE_ONLY, slot.result.data(), slot.result.size());
+			const cl::Buffer* grey = GreyPlane(slot.grey, channels, numPixels);
+
+			//profiling records are tagged with the frame so they can be collected when it retires
+			profiler.frame = slot.frame.index;
+
+			cl::Event uploaded;
+			transfer.Upload(upload_queue, slot.input, image.data(), image.size(), uploaded);
+			profiler.Add("write input", uploaded, image.size());
+
+			SetSkew(slot.frame.modeShare);
+			SetSampling(numPixels, channels);
+			cl::Event computed;
+			EnqueueEqualise(slot.input, slot.output, image.width(), image.height()*image.depth(), channels, slot.frame.maxValue, uploaded, computed, grey);
+
+			vector<cl::Event> projected(1, computed);
+			transfer.Download(download_queue, slot.output, slot.result.data(), slot.result.size(), &projected, slot.downloaded, false);
+			profiler.Add("read output", slot.downloaded, slot.result.size());
+			slot.busy = true;
+			submitted++;
+
+			//get all three queues going before the host blocks on anything
+			upload_queue.flush();
+			queue.flush();
+			download_queue.flush();
+		}
+
+		//drain the frames still in flight, oldest first
+		for (int k = 0; k < numSlots; k++) {
+			StreamSlot& slot = slots[(submitted + k) % numSlots];
+			if (slot.busy)
+				Retire(slot, consume);
+		}
+	}
+};
@@ -1,9 +1,17 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
 
 #include "Utils.h"
 #include "CImg.h"
+#include "Equaliser.h"
+#include "PNM.h"
 
 
 using namespace cimg_library;
@@ -15,236 +23,345 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.pgm)" << std::endl;
-	std::cerr << "  -b : define number of bins (default: 256)" << std::endl;
+	std::cerr << "  -b : define number of bins (default: 256, up to 65536)" << std::endl;
+	std::cerr << "  -r : maximum local sub-histogram replicas (default: 8)" << std::endl;
+	std::cerr << "  -u : limit the histogram to this many compute units (default: all)" << std::endl;
+	std::cerr << "  -S : separate normalise and scaled kernels instead of the fused LUT kernel" << std::endl;
+	std::cerr << "  -a : approximate histogram for previews, from a sample of the pixels with this expected L1 error (e.g. 0.05)" << std::endl;
+	std::cerr << "  -H : print the R, G, B and luma histograms of a colour image and the equalisation LUT of each, from one pass" << std::endl;
+	std::cerr << "  -y : colour space colour images are equalised in: luma (scale R, G and B, default), ycbcr (keep Cb/Cr) or hsv (keep H/S)" << std::endl;
+	std::cerr << "  -c : CLAHE, adaptive equalisation over an n x n grid of tiles (e.g. 8) instead of one histogram for the image" << std::endl;
+	std::cerr << "  -x : CLAHE clip limit, as a multiple of the mean bin count of a tile (default: 3)" << std::endl;
+	std::cerr << "  -k : merge runs of equal bins in the histogram when one value holds at least this share of a pixel sample (default: 0.25)" << std::endl;
+	std::cerr << "  -U : untuned, ignore the device's tuning file (written by Bench -t), use the default launch parameters" << std::endl;
+	std::cerr << "  -g : generic kernels, with the bin count, channel count and layout as arguments instead of built in" << std::endl;
+	std::cerr << "  -G : separate rgb2grey and histogram kernels for colour images instead of the fused one" << std::endl;
+	std::cerr << "  -C : always copy images to and from the device, even when it shares memory with the host" << std::endl;
+	std::cerr << "  -T : equalise in bands of at most this many rows (default: only images too large for the device)" << std::endl;
+	std::cerr << "  -M : host memory budget for the bands in MB (default: 256)" << std::endl;
+	std::cerr << "  -P : stream PGM/PPM files band by band from a memory mapping, never loading a whole image" << std::endl;
+	std::cerr << "  -16 : batch mode 16-bit images (single PGM/PPM files are detected from their header)" << std::endl;
+	std::cerr << "  -D : debug, print every intermediate histogram (adds a host sync per stage)" << std::endl;
+	std::cerr << "  -B : batch mode over a directory, glob pattern or list file (one image path per line)" << std::endl;
+	std::cerr << "  -s : batch mode streaming pipeline, overlaps decoding, upload, kernels and download across frames" << std::endl;
+	std::cerr << "  -o : output image file, - for a PNM on stdout (batch mode: output directory, default: no output written)" << std::endl;
+	std::cerr << "  -n : headless, no display windows (always on in the headless build)" << std::endl;
+	std::cerr << "  --profile : time every write, kernel and read and print a per-stage table" << std::endl;
+	std::cerr << "  --profile-out : also write the per-stage figures to a file, CSV for *.csv and JSON otherwise" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
+//expand a batch specification into a list of image files: a directory, a glob pattern or a list file
+vector<string> GetBatchFiles(const string& spec) {
+	vector<string> files;
+	struct stat info;
+
+	if ((stat(spec.c_str(), &info) == 0) && S_ISDIR(info.st_mode)) {
+		DIR* dir = opendir(spec.c_str());
+		if (dir) {
+			struct dirent* entry;
+			while ((entry = readdir(dir)) != NULL) {
+				string name = entry->d_name;
+				if (IsPNMFile(name))
+					files.push_back(spec + "/" + name);
+			}
+			closedir(dir);
+		}
+		std::sort(files.begin(), files.end());
+	}
+	else if (spec.find_first_of("*?[") != string::npos) {
+		glob_t matches;
+		if (glob(spec.c_str(), 0, NULL, &matches) == 0) {
+			for (size_t i = 0; i < matches.gl_pathc; i++)
+				files.push_back(matches.gl_pathv[i]);
+		}
+		globfree(&matches);
+	}
+	else {
+		ifstream list(spec);
+		string line;
+		while (getline(list, line)) {
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if (!line.empty() && (line[0] != '#'))
+				files.push_back(line);
+		}
+	}
+
+	return files;
+}
+
+//write an image, "-" sends a binary PNM to stdout
+template <typename T>
+void SaveImage(const CImg<T>& image, const string& file_name) {
+	image.save((file_name == "-") ? "-.pnm" : file_name.c_str());
+}
+
+//bytes per sample of a binary PGM/PPM file from its header, 0 when it is not one we can read
+int PNMSampleBytes(const string& file_name) {
+	if (!IsPNMFile(file_name))
+		return 0;
+	try {
+		return PNMReader(file_name).sampleBytes;
+	}
+	catch (CImgException&) {
+		return 0;
+	}
+}
+
+string BaseName(const string& path) {
+	size_t slash = path.find_last_of('/');
+	return (slash == string::npos) ? path : path.substr(slash + 1);
+}
+
+//equalise one image with pixels of type T, save it when output is set and show both until one window is closed
+template <typename T>
+void EqualiseFile(Equaliser& equaliser, const string& image_filename, const string& output, bool headless) {
+	CImg<T> image_input(image_filename.c_str());
+	CImg<T> output_image = equaliser.Run(image_input);
+
+	if (!output.empty())
+		SaveImage(output_image, output);
+
+	//the headless build has no windows to show
+	(void)headless;
+#if cimg_display != 0
+	if (!headless) {
+		CImgDisplay disp_input(image_input,"input");
+		CImgDisplay disp_output(output_image,"output");
+
+		while (!disp_input.is_closed() && !disp_output.is_closed()
+			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+			disp_input.wait(1);
+			disp_output.wait(1);
+		}
+	}
+#endif
+}
+
+//one image of a sequential batch, returns false when it cannot be loaded
+template <typename T>
+bool EqualiseBatchFile(Equaliser& equaliser, const string& file_name, const string& output, double& image_ms, double& pixels) {
+	CImg<T> image_input;
+	try {
+		image_input.assign(file_name.c_str());
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << file_name << ": " << err.what() << std::endl;
+		return false;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CImg<T> output_image = equaliser.Run(image_input);
+	image_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	if (!output.empty())
+		SaveImage(output_image, output + "/" + BaseName(file_name));
+
+	pixels = (double)image_input.width()*image_input.height();
+	std::cout << file_name << ": " << image_input.width() << "x" << image_input.height() << "x" << image_input.spectrum()
+		<< ", " << image_ms << " ms, " << pixels/(image_ms*1000.0) << " MPix/s" << std::endl;
+	return true;
+}
+
+//R, G, B and luma histograms of a colour image with the LUT each would equalise its channel with
+template <typename T>
+void PrintChannelHistograms(Equaliser& equaliser, const string& image_filename) {
+	CImg<T> image_input(image_filename.c_str());
+	ChannelHistograms stats = equaliser.Histograms(image_input, true);
+	const char* names[] = { "R", "G", "B", "Luma" };
+	for (int c = 0; c < 4; c++) {
+		std::cout << names[c] << " Hist = " << stats.histograms[c] << std::endl;
+		std::cout << names[c] << " LUT = " << stats.luts[c] << std::endl;
+	}
+}
+
+void ReportProfile(const Profiler& profiler, const string& device_name, const string& file_name) {
+	std::cout << profiler.Table();
+	if (!file_name.empty())
+		profiler.Write(file_name, device_name);
+}
+
 int main(int argc, char **argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename = "test.pgm";
-	int numBins = 256;
-	int maxValue;
+	string batch_spec;
+	string output;
+	bool stream = false;
+	bool stream_pnm = false;
+	bool channel_stats = false;
+	bool headless = (cimg_display == 0);
+	string profile_output;
+	EqualiserOptions options;
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
-		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { numBins = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { options.numBins = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { options.maxReplicas = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { options.computeUnits = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-S") == 0) { options.fuseLut = false; }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { options.sampleError = (float)atof(argv[++i]); }
+		else if (strcmp(argv[i], "-H") == 0) { channel_stats = true; }
+		else if ((strcmp(argv[i], "-y") == 0) && (i < (argc - 1))) {
+			string space = argv[++i];
+			options.colourSpace = (space == "hsv") ? COLOUR_HSV : ((space == "ycbcr") ? COLOUR_YCBCR : COLOUR_LUMA);
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { options.claheTiles = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { options.claheClip = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { options.skewThreshold = (float)atof(argv[++i]); }
+		else if (strcmp(argv[i], "-U") == 0) { options.tuned = false; }
+		else if (strcmp(argv[i], "-g") == 0) { options.specialise = false; }
+		else if (strcmp(argv[i], "-G") == 0) { options.fuseHistogram = false; }
+		else if (strcmp(argv[i], "-C") == 0) { options.zeroCopy = false; }
+		else if ((strcmp(argv[i], "-T") == 0) && (i < (argc - 1))) { options.bandRows = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-M") == 0) && (i < (argc - 1))) { options.hostBudget = (size_t)atoi(argv[++i]) << 20; }
+		else if (strcmp(argv[i], "-D") == 0) { options.debug = true; }
+		else if ((strcmp(argv[i], "-B") == 0) && (i < (argc - 1))) { batch_spec = argv[++i]; }
+		else if (strcmp(argv[i], "-s") == 0) { stream = true; }
+		else if (strcmp(argv[i], "-P") == 0) { stream_pnm = true; }
+		else if (strcmp(argv[i], "-16") == 0) { options.pixelBytes = 2; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output = argv[++i]; }
+		else if (strcmp(argv[i], "-n") == 0) { headless = true; }
+		else if (strcmp(argv[i], "--profile") == 0) { options.profile = true; }
+		else if ((strcmp(argv[i], "--profile-out") == 0) && (i < (argc - 1))) { options.profile = true; profile_output = argv[++i]; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
 	cimg::exception_mode(0);
 
+	//headless runs exit as soon as the result is written, stdout being the default destination.
+	//the same goes for streamed PGM/PPM files, which cannot be displayed
+	if ((headless || stream_pnm) && output.empty() && batch_spec.empty())
+		output = "-";
+
+	//the image goes to stdout, so everything else has to go to stderr
+	if (output == "-")
+		std::cout.rdbuf(std::cerr.rdbuf());
+
 	//detect any potential exceptions
 	try {
-		CImg<unsigned char> image_input(image_filename.c_str());
-        CImg<unsigned char> grey_image;
-		
-		std::cout << "Image Size: " << image_input.size() << " bytes" << std::endl;
-		int channels = image_input.spectrum();
-        string ColourSpace;
-        int preferredWorkSize;
-        int globalWorkSize;
-		CImgDisplay disp_input(image_input,"input");
+		bool batch = !batch_spec.empty();
 
-		//Part 3 - host operations
-		//3.1 Select computing devices
-		cl::Context context = GetContext(platform_id, device_id);
+		//the program is built for one pixel type, a single 16-bit PGM/PPM file picks it from its header
+		if (!batch && (PNMSampleBytes(image_filename) == 2))
+			options.pixelBytes = 2;
+
+		//Part 3 - host operations, done once and shared by every image
+		std::chrono::steady_clock::time_point setup_start = std::chrono::steady_clock::now();
+		options.verbose = !batch;
+		Equaliser equaliser(platform_id, device_id, options);
+		double setup_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setup_start).count();
 
 		//display the selected device
 		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context);
+		if (!batch && stream_pnm) {
+			EqualisePNM(equaliser, image_filename, output);
+			if (options.profile)
+				ReportProfile(equaliser.profiler, GetDeviceName(platform_id, device_id), profile_output);
+			return 0;
+		}
 
-		//3.2 Load & build the device code
-		cl::Program::Sources sources;
+		if (!batch && channel_stats) {
+			if (options.pixelBytes == 2)
+				PrintChannelHistograms<unsigned short>(equaliser, image_filename);
+			else
+				PrintChannelHistograms<unsigned char>(equaliser, image_filename);
+			if (options.profile)
+				ReportProfile(equaliser.profiler, GetDeviceName(platform_id, device_id), profile_output);
+			return 0;
+		}
 
-		AddSources(sources, "kernels/my_kernels.cl");
+		if (!batch) {
+			if (options.pixelBytes == 2)
+				EqualiseFile<unsigned short>(equaliser, image_filename, output, headless);
+			else
+				EqualiseFile<unsigned char>(equaliser, image_filename, output, headless);
+			if (options.profile)
+				ReportProfile(equaliser.profiler, GetDeviceName(platform_id, device_id), profile_output);
+			return 0;
+		}
 
-		cl::Program program(context, sources);
+		vector<string> files = GetBatchFiles(batch_spec);
+		std::cout << "Batch: " << files.size() << " image(s), setup (context + program build) " << setup_ms << " ms" << std::endl;
 
-		//build and debug the kernel code
-		try { 
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
+		int processed = 0;
+		double total_ms = 0.0;
+		double total_pixels = 0.0;
 
-		std::cout << channels << std::endl;
-		
-        if (channels == 4) {
-            //RGBA
-            ColourSpace = "RGBA";
-			std::cout << ColourSpace << std::endl;
-        }
-        else if (channels == 3) {
-            //RGB
-            cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-            cl::Buffer dev_image_grey(context, CL_MEM_READ_WRITE, image_input.size()/channels);
-
-            queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-
-            cl::Kernel RGBKernel = cl::Kernel(program, "rgb2grey");
-            RGBKernel.setArg(0, dev_image_input);
-            RGBKernel.setArg(1, dev_image_grey);
-			RGBKernel.setArg(2, channels);
-
-            cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
-            preferredWorkSize = RGBKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
-            globalWorkSize = ((image_input.size() * preferredWorkSize-1)/preferredWorkSize)*preferredWorkSize;
-
-			queue.enqueueNDRangeKernel(RGBKernel, cl::NullRange, cl::NDRange(image_input.size()/channels), cl::NullRange);
-
-            vector<unsigned char> grey_buffer(image_input.size()/channels);
-
-            queue.enqueueReadBuffer(dev_image_grey, CL_TRUE, 0, grey_buffer.size(), &grey_buffer.data()[0]);
-
-            CImg<unsigned char> temp_grey_image(grey_buffer.data(), image_input.width(), image_input.height());
-            ColourSpace = "RGB";
-			grey_image.assign(temp_grey_image);
-			std::cout << ColourSpace << std::endl;
-        }
-        else {
-            //Greyscale
-            grey_image.assign(image_input);
-            ColourSpace = "Grey";
-			std::cout << ColourSpace << std::endl;
-        }
-
-		CImgDisplay disp_grey(grey_image,"greyscale");
-		std::cout << (int)grey_image.max() << std::endl;
-
-		for (int i=1; i<17; i++) {
-			if (int(pow(2.0, i)) > (int)grey_image.max()) {
-				maxValue = pow(2.0, i);
-				break;
-			}
+		if (stream) {
+			//frames overlap, so only the time between consecutive results is meaningful per image
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point last = start;
+
+			equaliser.Stream(files, [&](const Frame& frame, const CImg<unsigned char>& output_image) {
+				if (!output.empty())
+					SaveImage(output_image, output + "/" + BaseName(frame.name));
+
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				double interval_ms = std::chrono::duration<double, std::milli>(now - last).count();
+				last = now;
+
+				double pixels = (double)frame.image.width()*frame.image.height();
+				processed++;
+				total_pixels += pixels;
+
+				std::cout << frame.name << ": " << frame.image.width() << "x" << frame.image.height() << "x" << frame.image.spectrum()
+					<< ", +" << interval_ms << " ms" << std::endl;
+			});
+
+			total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 		}
-		std::cout << maxValue << std::endl;
-
-		//Histogram
-		std::cout << numBins << std::endl;
-
-		int histogramSize = numBins*4;
-		std::vector<int> Hist(numBins);
-		
-		cl::Buffer dev_grey_input(context, CL_MEM_READ_ONLY, grey_image.size());
-		cl::Buffer partial_hist(context, CL_MEM_READ_WRITE, histogramSize);
-		queue.enqueueWriteBuffer(dev_grey_input, CL_TRUE, 0, (int)grey_image.size(), &grey_image.data()[0]);
-		std::vector<int> localHistogram;
-		
-		cl::Kernel histKernel = cl::Kernel(program, "histogram");
-		histKernel.setArg(0, dev_grey_input);
-		histKernel.setArg(1, (int) grey_image.size());
-		histKernel.setArg(2, partial_hist);
-		histKernel.setArg(3, numBins);
-		histKernel.setArg(4, maxValue);
-		histKernel.setArg(5, numBins*sizeof(int), NULL);
-
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
-        preferredWorkSize = histKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
-        globalWorkSize = ((image_input.size() * preferredWorkSize-1)/preferredWorkSize)*preferredWorkSize;
-		std::cout << preferredWorkSize << std::endl;
-		std::cout << globalWorkSize << std::endl;
-		
-		queue.enqueueNDRangeKernel(histKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange);
-		cl_ulong partial_hist_size;
-		partial_hist.getInfo(CL_MEM_SIZE, &partial_hist_size);
-		std::cout << "Buffer size: " << partial_hist_size << " bytes" << std::endl;
-
-		queue.enqueueReadBuffer(partial_hist, CL_TRUE, 0, histogramSize, &Hist[0]);
-		std::cout << "Original Hist = " << Hist << std::endl;
-
-		cl::Kernel scanKernel = cl::Kernel(program, "scanBL");
-		scanKernel.setArg(0, partial_hist);
-
-		queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange);
-		queue.enqueueReadBuffer(partial_hist, CL_TRUE, 0, histogramSize, &Hist[0]);
-		std::cout << "Scan Hist = " << Hist << std::endl;
-
-		std::vector<float> FloatHist(numBins);
-		cl::Kernel normaliseKernel = cl::Kernel(program, "normalise");
-		normaliseKernel.setArg(0, partial_hist);
-		normaliseKernel.setArg(1, histogramSize);
-
-		queue.enqueueNDRangeKernel(normaliseKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange);
-		queue.enqueueReadBuffer(partial_hist, CL_TRUE, 0, histogramSize, &FloatHist[0]);
-		std::cout << "Float Hist = " << FloatHist << std::endl;
-
-		cl::Buffer scaledBuffer(context, CL_MEM_READ_WRITE, histogramSize);
-		cl::Kernel scaledKernel = cl::Kernel(program, "scaled");
-		scaledKernel.setArg(0, partial_hist);
-		scaledKernel.setArg(1, scaledBuffer);
-		scaledKernel.setArg(2, numBins);
-		scaledKernel.setArg(3, maxValue);
-
-		queue.enqueueNDRangeKernel(scaledKernel, cl::NullRange, cl::NDRange(numBins), cl::NullRange);
-		queue.enqueueReadBuffer(scaledBuffer, CL_TRUE, 0, histogramSize, &Hist[0]);
-		std::cout << "Scaled Hist = " << Hist << Hist.size() << std::endl;
-
-		int scaleFactor = 256/numBins;
-
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_input.size());
-		std::vector<unsigned char> output_buffer(image_input.size()/channels);
-        if (ColourSpace == "Grey") { //differing projections for greyscale, rgb, rgba
-			cl::Kernel backProjGrey = cl::Kernel(program, "backProjection");
-			backProjGrey.setArg(0, dev_grey_input);
-			backProjGrey.setArg(1, dev_image_output);
-			backProjGrey.setArg(2, scaledBuffer);
-			backProjGrey.setArg(3, scaleFactor);
-			
-			queue.enqueueNDRangeKernel(backProjGrey, cl::NullRange, cl::NDRange(grey_image.size()), cl::NullRange);
-
-			std::cout << "Here1" << std::endl;
-
-			cl_ulong dev_image_size;
-			dev_image_output.getInfo(CL_MEM_SIZE, &dev_image_size);
-			std::cout << "Image size:  " << dev_image_size << " bytes" << std::endl;
-			std::cout << "Buffer size: " << output_buffer.size() << " bytes" << std::endl;
-
-			queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0]);
+		else if (stream_pnm) {
+			//only a band of each image is ever in host memory
+			for (size_t i = 0; i < files.size(); i++) {
+				if (!IsPNMFile(files[i])) {
+					std::cerr << "ERROR: " << files[i] << ": not a PGM/PPM file" << std::endl;
+					continue;
+				}
+
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				double pixels;
+				try {
+					pixels = (double)EqualisePNM(equaliser, files[i], output.empty() ? "" : output + "/" + BaseName(files[i]));
+				}
+				catch (CImgException& err) {
+					std::cerr << "ERROR: " << files[i] << ": " << err.what() << std::endl;
+					continue;
+				}
+				double image_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+				processed++;
+				total_ms += image_ms;
+				total_pixels += pixels;
+				std::cout << files[i] << ": " << image_ms << " ms, " << pixels/(image_ms*1000.0) << " MPix/s" << std::endl;
+			}
 		}
 		else {
-			cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-			queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-
-			cl::Kernel backProjColour = cl::Kernel(program, "backProjRGBA");
-			backProjColour.setArg(0, dev_image_input);
-			backProjColour.setArg(1, dev_image_output);
-			backProjColour.setArg(2, scaledBuffer);
-			backProjColour.setArg(3, maxValue);
-			backProjColour.setArg(4, channels);
-			backProjColour.setArg(5, scaleFactor);
-			
-			queue.enqueueNDRangeKernel(backProjColour, cl::NullRange, cl::NDRange(grey_image.size()), cl::NullRange);
-
-			std::cout << "Here1" << std::endl;
-
-			cl_ulong dev_image_size;
-			dev_image_output.getInfo(CL_MEM_SIZE, &dev_image_size);
-			std::cout << "Image size:  " << dev_image_size << " bytes" << std::endl;
-			std::cout << "Buffer size: " << output_buffer.size() << " bytes" << std::endl;
-
-			queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, image_input.size(), &output_buffer.data()[0]);
+			for (size_t i = 0; i < files.size(); i++) {
+				double image_ms, pixels;
+				bool ok = (options.pixelBytes == 2) ? EqualiseBatchFile<unsigned short>(equaliser, files[i], output, image_ms, pixels)
+					: EqualiseBatchFile<unsigned char>(equaliser, files[i], output, image_ms, pixels);
+				if (!ok)
+					continue;
+
+				processed++;
+				total_ms += image_ms;
+				total_pixels += pixels;
+			}
 		}
-		std::cout << "Here2" << std::endl;
-		CImg<unsigned char> output_image(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), 1);
-		CImgDisplay disp_output(output_image,"output");
-
- 		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-		    disp_input.wait(1);
-		    disp_output.wait(1);
-	    }
 
+		if (processed > 0) {
+			std::cout << "Total: " << processed << " image(s) in " << total_ms << " ms, "
+				<< processed/(total_ms/1000.0) << " images/s, " << total_pixels/(total_ms*1000.0) << " MPix/s" << std::endl;
+			std::cout << equaliser.pool.Report() << std::endl;
+		}
+		if (options.profile)
+			ReportProfile(equaliser.profiler, GetDeviceName(platform_id, device_id), profile_output);
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
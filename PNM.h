@@ -0,0 +1,272 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CImg.h"
+#include "Equaliser.h"
+
+using namespace cimg_library;
+
+//16-bit PGM / PPM samples are big-endian, the devices and hosts we run on are not: copy bytes swapping every pair
+void SwapBytes16(const unsigned char* source, unsigned char* dest, size_t bytes) {
+	for (size_t i = 0; i + 1 < bytes; i += 2) {
+		unsigned char high = source[i];
+		dest[i] = source[i + 1];
+		dest[i + 1] = high;
+	}
+}
+
+//binary PGM (P5) / PPM (P6) file mapped into memory. the header is parsed in place and 8-bit pixels are used straight
+//from the mapping - page cache to device is the only copy - so the image is never decoded as a whole.
+//16-bit pixels (maxval above 255) are byte-swapped into the staging buffer on the way.
+//pixels are interleaved (RGBRGB...)
+struct PNMReader {
+	string name;
+	int width;
+	int height;
+	int channels;
+	int maxval;
+	int sampleBytes; //1, or 2 when maxval > 255
+	size_t rowBytes;
+	const unsigned char* payload;
+	void* mapping;
+	size_t mapping_size;
+
+	PNMReader() : width(0), height(0), channels(0), maxval(0), sampleBytes(0), rowBytes(0), payload(NULL), mapping(NULL), mapping_size(0) {}
+
+	explicit PNMReader(const string& file_name) : width(0), height(0), channels(0), maxval(0), sampleBytes(0), rowBytes(0), payload(NULL), mapping(NULL), mapping_size(0) {
+		Open(file_name);
+	}
+
+	~PNMReader() { Close(); }
+
+	void Open(const string& file_name) {
+		Close();
+		name = file_name;
+
+		int fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw CImgIOException("PNMReader: cannot open '%s'", file_name.c_str());
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close(fd);
+			throw CImgIOException("PNMReader: cannot read '%s'", file_name.c_str());
+		}
+		mapping_size = (size_t)info.st_size;
+		mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			mapping = NULL;
+			throw CImgIOException("PNMReader: cannot map '%s'", file_name.c_str());
+		}
+
+		//the mapping has to go again if the header is no good, the destructor will not run for a failed constructor
+		try {
+			const unsigned char* data = (const unsigned char*)mapping;
+			size_t pos = 2;
+			if ((mapping_size < 2) || (data[0] != 'P') || ((data[1] != '5') && (data[1] != '6')))
+				throw CImgIOException("PNMReader: '%s' is not a binary PGM/PPM file", file_name.c_str());
+			channels = (data[1] == '5') ? 1 : 3;
+
+			if (!ReadNumber(data, pos, width) || !ReadNumber(data, pos, height) || !ReadNumber(data, pos, maxval)
+				|| (pos >= mapping_size) || !isspace(data[pos]))
+				throw CImgIOException("PNMReader: bad header in '%s'", file_name.c_str());
+			pos++; //exactly one whitespace character after maxval
+
+			if ((width <= 0) || (height <= 0) || (maxval <= 0) || (maxval > 65535))
+				throw CImgIOException("PNMReader: '%s' is not an 8 or 16-bit image (%dx%d, maxval %d)", file_name.c_str(), width, height, maxval);
+
+			sampleBytes = (maxval > 255) ? 2 : 1;
+			rowBytes = (size_t)width*channels*sampleBytes;
+			if (pos + rowBytes*height > mapping_size)
+				throw CImgIOException("PNMReader: '%s' is truncated", file_name.c_str());
+			payload = data + pos;
+
+			//bands are read front to back (twice), start the readahead now
+			madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+			madvise(mapping, mapping_size, MADV_WILLNEED);
+		}
+		catch (CImgException&) {
+			Close();
+			throw;
+		}
+	}
+
+	void Close() {
+		if (mapping)
+			munmap(mapping, mapping_size);
+		mapping = NULL;
+		payload = NULL;
+	}
+
+	//rows [y0, y0 + rows), interleaved and in the byte order of the file
+	const unsigned char* Rows(int y0, int rows) const {
+		//ask for the band after this one while the device is busy with this one
+		Prefetch(y0 + rows, rows);
+		return payload + y0*rowBytes;
+	}
+
+	//copy rows [y0, y0 + rows) into data, 16-bit samples in host byte order
+	void Rows(int y0, int rows, unsigned char* data) const {
+		if (sampleBytes == 2)
+			SwapBytes16(Rows(y0, rows), data, rows*rowBytes);
+		else
+			memcpy(data, Rows(y0, rows), rows*rowBytes);
+	}
+
+	//hands 8-bit mapped rows to the tiled engine as they are, no staging copy. 16-bit rows need swapping, into the staging buffer
+	BandReader Bands() const {
+		if (sampleBytes == 2)
+			return [this](int y0, int rows, unsigned char* staging) -> const unsigned char* { Rows(y0, rows, staging); return staging; };
+		return [this](int y0, int rows, unsigned char*) { return Rows(y0, rows); };
+	}
+
+	//ModeShare of the file's intensities, sampled straight from the mapping
+	float ModeShare() const {
+		const unsigned char* data = payload;
+		int samples = channels, bytes = sampleBytes;
+		return ::ModeShare((size_t)width*height, [=](size_t i) {
+			const unsigned char* pixel = data + i*samples*bytes;
+			int value[3];
+			for (int c = 0; c < std::min(samples, 3); c++)
+				value[c] = (bytes == 2) ? (pixel[2*c] << 8) | pixel[2*c + 1] : pixel[c];
+			return (samples >= 3) ? (int)(0.2126f*value[0] + 0.7152f*value[1] + 0.0722f*value[2]) : value[0];
+		});
+	}
+
+	void Prefetch(int y0, int rows) const {
+		if (y0 >= height)
+			return;
+		rows = std::min(rows, height - y0);
+		//madvise wants page aligned addresses
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t begin = (size_t)(payload - (const unsigned char*)mapping) + y0*rowBytes;
+		size_t end = begin + rows*rowBytes;
+		begin -= begin % page;
+		madvise((char*)mapping + begin, end - begin, MADV_WILLNEED);
+	}
+
+private:
+	//next decimal number of the header, skipping whitespace and # comments
+	bool ReadNumber(const unsigned char* data, size_t& pos, int& value) const {
+		while (pos < mapping_size) {
+			if (data[pos] == '#') {
+				while ((pos < mapping_size) && (data[pos] != '\n'))
+					pos++;
+			}
+			else if (isspace(data[pos]))
+				pos++;
+			else
+				break;
+		}
+		if ((pos >= mapping_size) || !isdigit(data[pos]))
+			return false;
+		value = 0;
+		while ((pos < mapping_size) && isdigit(data[pos]))
+			value = value*10 + (data[pos++] - '0');
+		return true;
+	}
+
+	PNMReader(const PNMReader&);
+	PNMReader& operator=(const PNMReader&);
+};
+
+//binary PGM / PPM writer that takes the image a band of rows at a time, in order. "-" writes to stdout.
+//maxval above 255 writes 16-bit samples, taken in host byte order
+struct PNMWriter {
+	FILE* file;
+	int width;
+	int height;
+	int channels;
+	int sampleBytes;
+	int rows_written;
+	vector<unsigned char> swapped;
+
+	PNMWriter() : file(NULL), width(0), height(0), channels(0), sampleBytes(0), rows_written(0) {}
+
+	PNMWriter(const string& file_name, int w, int h, int c, int maxval) : file(NULL), width(0), height(0), channels(0), sampleBytes(0), rows_written(0) {
+		Open(file_name, w, h, c, maxval);
+	}
+
+	~PNMWriter() { Close(); }
+
+	void Open(const string& file_name, int w, int h, int c, int maxval) {
+		Close();
+		width = w;
+		height = h;
+		channels = c;
+		sampleBytes = (maxval > 255) ? 2 : 1;
+		rows_written = 0;
+		file = (file_name == "-") ? stdout : fopen(file_name.c_str(), "wb");
+		if (!file)
+			throw CImgIOException("PNMWriter: cannot create '%s'", file_name.c_str());
+		fprintf(file, "P%c\n%d %d\n%d\n", (channels == 1) ? '5' : '6', width, height, maxval);
+	}
+
+	void Close() {
+		if (file && (file != stdout))
+			fclose(file);
+		else if (file)
+			fflush(file);
+		file = NULL;
+	}
+
+	//append rows, interleaved as in the file
+	void Rows(int rows, const unsigned char* data) {
+		size_t bytes = (size_t)rows*width*channels*sampleBytes;
+		if (sampleBytes == 2) {
+			swapped.resize(bytes);
+			SwapBytes16(data, &swapped[0], bytes);
+			data = &swapped[0];
+		}
+		if (fwrite(data, 1, bytes, file) != bytes)
+			throw CImgIOException("PNMWriter: write failed");
+		rows_written += rows;
+	}
+
+	BandWriter Bands() {
+		return [this](int, int rows, const unsigned char* data) { Rows(rows, data); };
+	}
+
+private:
+	PNMWriter(const PNMWriter&);
+	PNMWriter& operator=(const PNMWriter&);
+};
+
+bool IsPNMFile(const string& file_name) {
+	size_t dot = file_name.find_last_of('.');
+	if (dot == string::npos)
+		return false;
+	string ext = file_name.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return (ext == "pgm") || (ext == "ppm") || (ext == "pnm");
+}
+
+//equalise a PGM / PPM file band by band: mapped input, rows written as they come back. an empty output discards them.
+//the equaliser has to be built for the sample size of the file. returns the number of pixels
+size_t EqualisePNM(Equaliser& equaliser, const string& input, const string& output) {
+	PNMReader reader(input);
+	if (reader.sampleBytes != equaliser.options.pixelBytes)
+		throw CImgArgumentException("EqualisePNM: '%s' has %d-bit samples, the equaliser is set up for %d-bit", input.c_str(),
+			8*reader.sampleBytes, 8*equaliser.options.pixelBytes);
+	//the LUT spans [0, MaxValue(maxval)-1], so that is the maxval of the output (the same as the input for 2^k-1)
+	PNMWriter writer;
+	if (!output.empty())
+		writer.Open(output, reader.width, reader.height, reader.channels, MaxValue(reader.maxval) - 1);
+	BandWriter write = writer.file ? writer.Bands() : BandWriter([](int, int, const unsigned char*) {});
+
+	//the bands are never all in memory at once, so the range is the full range of the file
+	equaliser.SetSkew(reader.ModeShare());
+	equaliser.RunTiled(reader.width, reader.height, reader.channels, MaxValue(reader.maxval), reader.Bands(), write, LAYOUT_INTERLEAVED);
+	return (size_t)reader.width*reader.height;
+}
@@ -14,29 +14,49 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -o : output image file, - for a PNM on stdout" << std::endl;
+	std::cerr << "  -n : headless, no display windows (always on in the headless build)" << std::endl;
+	std::cerr << "  --profile : time the write, kernel and read and print a per-stage table" << std::endl;
+	std::cerr << "  --profile-out : also write the per-stage figures to a file, CSV for *.csv and JSON otherwise" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
+//write an image, "-" sends a binary PNM to stdout
+void SaveImage(const CImg<unsigned char>& image, const string& file_name) {
+	image.save((file_name == "-") ? "-.pnm" : file_name.c_str());
+}
+
 int main(int argc, char **argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename = "test.ppm";
+	string output;
+	bool headless = (cimg_display == 0);
+	Profiler profiler;
+	string profile_output;
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output = argv[++i]; }
+		else if (strcmp(argv[i], "-n") == 0) { headless = true; }
+		else if (strcmp(argv[i], "--profile") == 0) { profiler.enabled = true; }
+		else if ((strcmp(argv[i], "--profile-out") == 0) && (i < (argc - 1))) { profiler.enabled = true; profile_output = argv[++i]; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
 	cimg::exception_mode(0);
 
+	//the image goes to stdout, so everything else has to go to stderr
+	if (output == "-")
+		std::cout.rdbuf(std::cerr.rdbuf());
+
 	//detect any potential exceptions
 	try {
 		CImg<unsigned char> image_input(image_filename.c_str());
-		CImgDisplay disp_input(image_input,"input");
 
 		//a 3x3 convolution mask implementing an averaging filter
 		std::vector<float> convolution_mask = { 1.f / 9, 1.f / 9, 1.f / 9,
@@ -51,55 +71,72 @@ int main(int argc, char **argv) {
 		std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
 		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context);
-
-		//3.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "kernels/my_kernels.cl");
-
-		cl::Program program(context, sources);
-
-		//build and debug the kernel code
-		try { 
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
+		cl::CommandQueue queue(context, profiler.enabled ? CL_QUEUE_PROFILING_ENABLE : 0);
+		profiler.print_events = true;
 
-		//RGB to Grey
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-		cl::Buffer dev_image_grey(context, CL_MEM_READ_WRITE, image_input.size()/3); //should be the same as input image
+		//3.2 Load & build the device code, reusing a cached binary when the source and device are unchanged
+		cl::Program program = BuildProgram(context, "kernels/my_kernels.cl");
 
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-
-		cl::Kernel RGBKernel = cl::Kernel(program, "rgb2grey");
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0]; // get device
+		Transfer transfer(device);
+		std::cout << "Transfers: " << transfer.Describe() << std::endl;
+
+		//RGB to Grey, CImg keeps the colour planes one after another. the grey image is allocated up front so
+		//that a device sharing host memory can write into it directly
+		int numPixels = image_input.width()*image_input.height()*image_input.depth();
+		CImg<unsigned char> grey_image(image_input.width(), image_input.height(), image_input.depth(), 1);
+		BufferPool pool(context);
+		cl::Buffer dev_image_input = transfer.Bind(pool, CL_MEM_READ_ONLY, image_input.data(), image_input.size());
+		cl::Buffer dev_image_grey = transfer.Bind(pool, CL_MEM_WRITE_ONLY, grey_image.data(), grey_image.size());
+
+		cl::Event written, converted, read;
+		transfer.Upload(queue, dev_image_input, image_input.data(), image_input.size(), written);
+		profiler.Add("write input", written, image_input.size());
+
+		cl::Kernel RGBKernel = cl::Kernel(program, RGB2GreyKernelName(LAYOUT_PLANAR));
 		RGBKernel.setArg(0, dev_image_input);
 		RGBKernel.setArg(1, dev_image_grey);
-		RGBKernel.setArg(2, 3);
-
-		int local_size = 256;
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0]; // get device
-		cerr << RGBKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE> (device) << endl; // get info
-		queue.enqueueNDRangeKernel(RGBKernel, cl::NullRange, cl::NDRange(image_input.size()/3), cl::NullRange);
-
-		vector<unsigned char> grey_buffer(image_input.size()/3);
-
-		queue.enqueueReadBuffer(dev_image_grey, CL_TRUE, 0, grey_buffer.size(), &grey_buffer.data()[0]);
+		RGBKernel.setArg(2, numPixels);
+		RGBKernel.setArg(3, image_input.spectrum());
+
+		//work-group size from the device's tuning file (Bench -t), left to the runtime when it has none
+		vector<int> tuned;
+		int local_size = Tuning(device).Get("rgb2grey_1", tuned, 1) ? tuned[0] : 0;
+		if ((size_t)local_size > RGBKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))
+			local_size = 0;
+		vector<cl::Event> uploaded(1, written);
+		queue.enqueueNDRangeKernel(RGBKernel, cl::NullRange, cl::NDRange(RoundUp(RGB2GreyGlobalSize(LAYOUT_PLANAR, numPixels), local_size)), LocalRange(local_size), &uploaded, &converted);
+		profiler.Add("rgb2grey", converted, (double)numPixels*(image_input.spectrum() + 1), numPixels);
+
+		vector<cl::Event> wait(1, converted);
+		transfer.Download(queue, dev_image_grey, grey_image.data(), grey_image.size(), &wait, read, true);
+		profiler.Add("read grey", read, grey_image.size());
+
+		if (profiler.enabled) {
+			profiler.Collect(0);
+			std::cout << profiler.Table();
+			if (!profile_output.empty())
+				profiler.Write(profile_output, GetDeviceName(platform_id, device_id));
+		}
 	
-		CImg<unsigned char> grey_image(grey_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), 1);
-		CImgDisplay disp_output(grey_image,"output");
-		
- 		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-		    disp_input.wait(1);
-		    disp_output.wait(1);
-	    }		
-
+		//headless runs exit as soon as the result is written, stdout being the default destination
+		if (headless && output.empty())
+			output = "-";
+		if (!output.empty())
+			SaveImage(grey_image, output);
+
+#if cimg_display != 0
+		if (!headless) {
+			CImgDisplay disp_input(image_input,"input");
+			CImgDisplay disp_output(grey_image,"output");
+
+			while (!disp_input.is_closed() && !disp_output.is_closed()
+				&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+				disp_input.wait(1);
+				disp_output.wait(1);
+			}
+		}
+#endif
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
@@ -2,8 +2,14 @@
 
 #include <fstream>
 #include <vector>
+#include <map>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/stat.h>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -128,6 +134,88 @@ void AddSources(cl::Program::Sources& sources, const string& file_name) {
 	sources.push_back((*source_code).c_str());
 }
 
+string LoadSource(const string& file_name) {
+	ifstream file(file_name);
+	if (!file.is_open()) {
+		cerr << "Cannot open kernel source " << file_name << endl;
+		throw cl::Error(CL_INVALID_VALUE, "LoadSource");
+	}
+	return string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
+}
+
+//64-bit FNV-1a hash, used to key the program binary cache
+unsigned long long HashString(const string& text, unsigned long long hash = 14695981039346656037ULL) {
+	for (size_t i = 0; i < text.size(); i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void PrintBuildLog(const cl::Program& program, const cl::Device& device) {
+	std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+	std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+	std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+}
+
+//build a program for the first device of the context, reusing a binary from cache_dir when one exists for the
+//same kernel source, build options, platform, device and driver version; an empty cache_dir disables the cache
+cl::Program BuildProgram(const cl::Context& context, const string& file_name, const string& options = "", const string& cache_dir = "kernels/cache", bool* cache_hit = NULL) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+	string source = LoadSource(file_name);
+
+	unsigned long long key = HashString(source);
+	key = HashString(options, key);
+	key = HashString(platform.getInfo<CL_PLATFORM_NAME>() + platform.getInfo<CL_PLATFORM_VERSION>(), key);
+	key = HashString(device.getInfo<CL_DEVICE_NAME>() + device.getInfo<CL_DEVICE_VERSION>() + device.getInfo<CL_DRIVER_VERSION>(), key);
+
+	stringstream cache_name;
+	cache_name << cache_dir << "/" << hex << setw(16) << setfill('0') << key << ".bin";
+
+	if (cache_hit)
+		*cache_hit = false;
+
+	if (!cache_dir.empty()) {
+		ifstream cached(cache_name.str(), ios::binary);
+		if (cached.is_open()) {
+			cl::Program::Binaries binaries(1, vector<unsigned char>(istreambuf_iterator<char>(cached), (istreambuf_iterator<char>())));
+			//a stale or corrupt binary is rejected by the runtime, in which case we fall through to a source build
+			try {
+				cl::Program program(context, vector<cl::Device>(1, device), binaries);
+				program.build(options.c_str());
+				if (cache_hit)
+					*cache_hit = true;
+				return program;
+			}
+			catch (const cl::Error&) {
+			}
+		}
+	}
+
+	cl::Program::Sources sources(1, source);
+	cl::Program program(context, sources);
+
+	//build and debug the kernel code
+	try {
+		program.build(options.c_str());
+	}
+	catch (const cl::Error& err) {
+		PrintBuildLog(program, device);
+		throw err;
+	}
+
+	if (!cache_dir.empty()) {
+		vector<vector<unsigned char> > binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+		mkdir(cache_dir.c_str(), 0755);
+		ofstream cached(cache_name.str(), ios::binary);
+		if (cached.is_open() && !binaries.empty() && !binaries[0].empty())
+			cached.write((const char*)&binaries[0][0], binaries[0].size());
+	}
+
+	return program;
+}
+
 string ListPlatformsDevices() {
 
 	stringstream sstream;
@@ -198,6 +286,253 @@ cl::Context GetContext(int platform_id, int device_id) {
 	return cl::Context();
 }
 
+//memory layout of multi-channel images, must match the LAYOUT_ defines in kernels/my_kernels.cl
+enum PixelLayout {
+	LAYOUT_PLANAR = 0, //CImg: RRR...GGG...BBB...
+	LAYOUT_INTERLEAVED = 1 //PPM files: RGBRGB...
+};
+
+//colour space colour images are equalised in, must match the COLOUR_ defines in kernels/my_kernels.cl
+enum ColourSpace {
+	COLOUR_LUMA = 0, //R, G and B scaled by the ratio of the equalised to the original luma
+	COLOUR_YCBCR = 1, //Y equalised, Cb and Cr kept
+	COLOUR_HSV = 2 //V equalised, H and S kept
+};
+
+//rgb2grey kernel for a layout and the number of pixels each of its work-items converts
+const char* RGB2GreyKernelName(PixelLayout layout) {
+	return (layout == LAYOUT_PLANAR) ? "rgb2greyPlanar" : "rgb2greyInterleaved";
+}
+
+size_t RGB2GreyGlobalSize(PixelLayout layout, size_t numPixels) {
+	size_t pixelsPerItem = (layout == LAYOUT_PLANAR) ? 16 : 4;
+	return (numPixels + pixelsPerItem - 1)/pixelsPerItem;
+}
+
+//global size for a launch with an explicit local size, which it has to be a multiple of. 0 - local size left to the runtime
+size_t RoundUp(size_t globalSize, size_t localSize) {
+	return (localSize == 0) ? globalSize : ((globalSize + localSize - 1)/localSize)*localSize;
+}
+
+cl::NDRange LocalRange(size_t localSize) {
+	return (localSize == 0) ? cl::NullRange : cl::NDRange(localSize);
+}
+
+//launch parameters found by the autotuner (Bench -t, make tune), one file per device in tuning_dir. every line is a key
+//("histogram_256_1"...) followed by its values; the key names and value order are up to the users of the file
+struct Tuning {
+	string file_name;
+	map<string, vector<int> > entries;
+
+	Tuning() {}
+
+	explicit Tuning(const cl::Device& device, const string& tuning_dir = "kernels/tuning") {
+		Open(device, tuning_dir);
+	}
+
+	//the file of a device, keyed like the binary cache on the platform, device and driver version. loads it when it exists
+	void Open(const cl::Device& device, const string& tuning_dir = "kernels/tuning") {
+		cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+		unsigned long long key = HashString(platform.getInfo<CL_PLATFORM_NAME>() + platform.getInfo<CL_PLATFORM_VERSION>());
+		key = HashString(device.getInfo<CL_DEVICE_NAME>() + device.getInfo<CL_DEVICE_VERSION>() + device.getInfo<CL_DRIVER_VERSION>(), key);
+		stringstream name;
+		name << tuning_dir << "/" << hex << setw(16) << setfill('0') << key << ".txt";
+		file_name = name.str();
+
+		entries.clear();
+		ifstream file(file_name);
+		string line;
+		while (getline(file, line)) {
+			if (line.empty() || (line[0] == '#'))
+				continue;
+			stringstream fields(line);
+			string entry;
+			int value;
+			fields >> entry;
+			while (fields >> value)
+				entries[entry].push_back(value);
+		}
+	}
+
+	//the values of key, when the file has exactly count of them
+	bool Get(const string& key, vector<int>& values, size_t count) const {
+		map<string, vector<int> >::const_iterator found = entries.find(key);
+		if ((found == entries.end()) || (found->second.size() != count))
+			return false;
+		values = found->second;
+		return true;
+	}
+
+	void Set(const string& key, const vector<int>& values) {
+		entries[key] = values;
+	}
+
+	void Save(const string& comment) const {
+		size_t slash = file_name.find_last_of('/');
+		if (slash != string::npos)
+			mkdir(file_name.substr(0, slash).c_str(), 0755);
+		ofstream file(file_name);
+		if (!file.is_open())
+			throw cl::Error(CL_INVALID_VALUE, "Tuning: cannot write the tuning file");
+		file << "# " << comment << endl;
+		for (map<string, vector<int> >::const_iterator entry = entries.begin(); entry != entries.end(); ++entry) {
+			file << entry->first;
+			for (size_t i = 0; i < entry->second.size(); i++)
+				file << " " << entry->second[i];
+			file << endl;
+		}
+	}
+};
+
+//size-classed pool of device buffers for one context. requests are rounded up to a size class (four per power
+//of two, so at most 25% is wasted) and released buffers are kept for the next request of the same class and
+//flags: the pool grows to the high-water mark and steady-state frames allocate nothing. the exception is host
+//memory used in place (Wrap): a wrapper for it is created for every image, cheap but counted separately
+struct BufferPool {
+	cl::Context context;
+	map<pair<cl_mem_flags, size_t>, vector<cl::Buffer> > available;
+	size_t allocated_bytes;
+	size_t allocations;
+	size_t reuses;
+	size_t in_use;
+	size_t wrapped; //buffers created around host memory
+
+	BufferPool() : allocated_bytes(0), allocations(0), reuses(0), in_use(0), wrapped(0) {}
+
+	explicit BufferPool(const cl::Context& ctx) : context(ctx), allocated_bytes(0), allocations(0), reuses(0), in_use(0), wrapped(0) {}
+
+	static size_t SizeClass(size_t size) {
+		size_t size_class = 4096;
+		while (size_class < size)
+			size_class *= 2;
+		//quarter steps between the powers of two
+		if (size_class > 4096) {
+			size_t step = size_class/8;
+			size_class = size_class/2 + ((size - size_class/2 + step - 1)/step)*step;
+		}
+		return size_class;
+	}
+
+	cl::Buffer Acquire(cl_mem_flags flags, size_t size) {
+		pair<cl_mem_flags, size_t> key(flags, SizeClass(size));
+		vector<cl::Buffer>& free_list = available[key];
+		in_use++;
+		if (!free_list.empty()) {
+			cl::Buffer buffer = free_list.back();
+			free_list.pop_back();
+			reuses++;
+			return buffer;
+		}
+		allocations++;
+		allocated_bytes += key.second;
+		return cl::Buffer(context, flags, key.second);
+	}
+
+	//buffer using size bytes of host memory in place. nothing is allocated on the device, but the buffer object is
+	//new every time - the host memory is a different image each time round - so it is never pooled
+	cl::Buffer Wrap(cl_mem_flags flags, void* data, size_t size) {
+		wrapped++;
+		return cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, size, data);
+	}
+
+	//hand a buffer back for reuse. buffers that wrap host memory and empty handles are not pooled.
+	//commands still using the buffer are fine, the queue orders them before any later use
+	void Release(cl::Buffer& buffer) {
+		if (buffer() == NULL)
+			return;
+		cl_mem_flags flags = buffer.getInfo<CL_MEM_FLAGS>();
+		if (!(flags & CL_MEM_USE_HOST_PTR)) {
+			available[make_pair(flags, (size_t)buffer.getInfo<CL_MEM_SIZE>())].push_back(buffer);
+			in_use--;
+		}
+		buffer = cl::Buffer();
+	}
+
+	string Report() const {
+		stringstream sstream;
+		sstream << "Buffer pool: " << allocations << " allocation(s), " << fixed << setprecision(1)
+			<< allocated_bytes/(1024.0*1024.0) << " MB on the device, " << reuses << " reuse(s), " << in_use << " in use, "
+			<< wrapped << " host buffer(s) wrapped";
+		return sstream.str();
+	}
+};
+
+//how host images get to and from a device. devices that share memory with the host (CPU runtimes, integrated
+//GPUs) use suitably aligned host memory in place (CL_MEM_USE_HOST_PTR) and map/unmap buffers allocated in host
+//memory for anything else; discrete devices get plain copies
+struct Transfer {
+	bool unified;
+	size_t alignment; //host pointers have to be aligned to this to be used in place
+
+	Transfer() : unified(false), alignment(4096) {}
+
+	Transfer(const cl::Device& device, bool allow_zero_copy = true) {
+		unified = allow_zero_copy && device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+		//CPU runtimes are happy with the base address alignment, GPUs want whole pages
+		alignment = 4096;
+		if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)
+			alignment = std::max((size_t)device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>()/8, (size_t)1);
+	}
+
+	bool CanWrap(const void* data) const {
+		return unified && ((size_t)data % alignment == 0);
+	}
+
+	//allocation flags for buffers that are filled from / read into host memory
+	cl_mem_flags Flags(cl_mem_flags flags) const {
+		return unified ? (flags | CL_MEM_ALLOC_HOST_PTR) : flags;
+	}
+
+	//device buffer for size bytes of host data: the host memory itself when it can be used in place (a new wrapper
+	//per call, see BufferPool::Wrap), otherwise one from the pool. either way it goes back with pool.Release
+	cl::Buffer Bind(BufferPool& pool, cl_mem_flags flags, const void* data, size_t size) const {
+		if (CanWrap(data))
+			return pool.Wrap(flags, const_cast<void*>(data), size);
+		return pool.Acquire(Flags(flags), size);
+	}
+
+	//get host data into a buffer from Bind, done completes once the device can use it.
+	//copies are non-blocking, so the data has to stay alive until then
+	void Upload(const cl::CommandQueue& queue, const cl::Buffer& buffer, const void* data, size_t size, cl::Event& done) const {
+		if (CanWrap(data)) {
+			queue.enqueueMarkerWithWaitList(NULL, &done);
+		}
+		else if (unified) {
+			void* mapped = queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size);
+			memcpy(mapped, data, size);
+			queue.enqueueUnmapMemObject(buffer, mapped, NULL, &done);
+		}
+		else {
+			queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, size, data, NULL, &done);
+		}
+	}
+
+	//get the contents of a buffer from Bind back into host memory once wait has completed.
+	//a buffer that wraps data itself is read into that same memory: the runtime can make the copy a no-op, and
+	//unlike a map followed straight by an unmap the host memory is guaranteed current once done completes
+	void Download(const cl::CommandQueue& queue, const cl::Buffer& buffer, void* data, size_t size, const vector<cl::Event>* wait, cl::Event& done, bool blocking) const {
+		if (unified && blocking && !CanWrap(data)) {
+			void* mapped = queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, size, wait);
+			memcpy(data, mapped, size);
+			queue.enqueueUnmapMemObject(buffer, mapped, NULL, &done);
+		}
+		else {
+			queue.enqueueReadBuffer(buffer, blocking, 0, size, data, wait, &done);
+		}
+		if (blocking)
+			done.wait();
+	}
+
+	string Describe() const {
+		stringstream sstream;
+		if (unified)
+			sstream << "zero-copy (host unified memory, " << alignment << " byte alignment)";
+		else
+			sstream << "copy";
+		return sstream.str();
+	}
+};
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,
@@ -223,3 +558,144 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 
 	return sstream.str();
 }
+
+//profiling figures of all the commands recorded under one stage name, times in [ns]
+struct StageProfile {
+	string name;
+	int count;
+	cl_ulong queued;
+	cl_ulong submitted;
+	cl_ulong executed;
+	cl_ulong total;
+	double bytes;
+	double pixels;
+
+	StageProfile() : count(0), queued(0), submitted(0), executed(0), total(0), bytes(0), pixels(0) {}
+};
+
+//keeps the event of every write, kernel and read enqueued on queues created with CL_QUEUE_PROFILING_ENABLE,
+//and folds them into per-stage totals once they have completed
+struct Profiler {
+	struct Record {
+		string name;
+		cl::Event event;
+		double bytes; //moved by a transfer, or read + written by a kernel
+		double pixels;
+		size_t frame;
+	};
+
+	bool enabled;
+	bool print_events; //print every command with GetFullProfilingInfo as it is collected
+	size_t frame; //frame that new records belong to
+	vector<Record> pending;
+	vector<StageProfile> stages; //in order of first appearance
+
+	Profiler() : enabled(false), print_events(false), frame(0) {}
+
+	void Add(const string& name, const cl::Event& event, double bytes, double pixels = 0) {
+		if (enabled) {
+			Record record = { name, event, bytes, pixels, frame };
+			pending.push_back(record);
+		}
+	}
+
+	StageProfile& Stage(const string& name) {
+		for (size_t i = 0; i < stages.size(); i++) {
+			if (stages[i].name == name)
+				return stages[i];
+		}
+		stages.push_back(StageProfile());
+		stages.back().name = name;
+		return stages.back();
+	}
+
+	//fold in the records of one frame, all of its commands must have completed
+	void Collect(size_t frame_index) {
+		vector<Record> remaining;
+		for (size_t i = 0; i < pending.size(); i++) {
+			const Record& record = pending[i];
+			if (record.frame != frame_index) {
+				remaining.push_back(record);
+				continue;
+			}
+			cl_ulong queued = record.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			cl_ulong submit = record.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			cl_ulong start = record.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong end = record.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+			StageProfile& stage = Stage(record.name);
+			stage.count++;
+			stage.queued += submit - queued;
+			stage.submitted += start - submit;
+			stage.executed += end - start;
+			stage.total += end - queued;
+			stage.bytes += record.bytes;
+			stage.pixels += record.pixels;
+
+			if (print_events)
+				cout << record.name << ": " << GetFullProfilingInfo(record.event, PROF_US) << endl;
+		}
+		pending.swap(remaining);
+	}
+
+	//human readable table of the mean time per command and the effective throughput of each stage
+	string Table(ProfilingResolution resolution = PROF_US) const {
+		stringstream sstream;
+		const char* unit = (resolution == PROF_NS) ? "ns" : (resolution == PROF_US) ? "us" : (resolution == PROF_MS) ? "ms" : "s";
+
+		sstream << left << setw(20) << "Stage" << right << setw(8) << "Calls" << setw(12) << "Queued" << setw(12) << "Submitted"
+			<< setw(12) << "Executed" << setw(12) << "Total" << setw(10) << "GB/s" << setw(12) << "MPix/s" << "  [" << unit << "]" << endl;
+		for (size_t i = 0; i < stages.size(); i++) {
+			const StageProfile& stage = stages[i];
+			double count = stage.count;
+			sstream << left << setw(20) << stage.name << right << setw(8) << stage.count << fixed << setprecision(1)
+				<< setw(12) << stage.queued/count/resolution << setw(12) << stage.submitted/count/resolution
+				<< setw(12) << stage.executed/count/resolution << setw(12) << stage.total/count/resolution
+				<< setprecision(2) << setw(10) << GBPerSecond(stage) << setw(12) << MPixPerSecond(stage) << endl;
+		}
+		return sstream.str();
+	}
+
+	static double GBPerSecond(const StageProfile& stage) {
+		return stage.executed ? stage.bytes/stage.executed : 0.0; //bytes per ns == GB/s
+	}
+
+	static double MPixPerSecond(const StageProfile& stage) {
+		return stage.executed ? stage.pixels*1000.0/stage.executed : 0.0;
+	}
+
+	string JSON(const string& device_name) const {
+		stringstream sstream;
+		sstream << "{\n  \"device\": \"" << device_name << "\",\n  \"stages\": [";
+		for (size_t i = 0; i < stages.size(); i++) {
+			const StageProfile& stage = stages[i];
+			double count = stage.count;
+			sstream << (i ? ",\n" : "\n") << "    {\"name\": \"" << stage.name << "\", \"calls\": " << stage.count
+				<< ", \"queued_ns\": " << stage.queued/count << ", \"submitted_ns\": " << stage.submitted/count
+				<< ", \"executed_ns\": " << stage.executed/count << ", \"total_ns\": " << stage.total/count
+				<< ", \"gb_per_s\": " << GBPerSecond(stage) << ", \"mpix_per_s\": " << MPixPerSecond(stage) << "}";
+		}
+		sstream << "\n  ]\n}\n";
+		return sstream.str();
+	}
+
+	string CSV(const string& device_name) const {
+		stringstream sstream;
+		sstream << "device,stage,calls,queued_ns,submitted_ns,executed_ns,total_ns,gb_per_s,mpix_per_s" << endl;
+		for (size_t i = 0; i < stages.size(); i++) {
+			const StageProfile& stage = stages[i];
+			double count = stage.count;
+			sstream << "\"" << device_name << "\"," << stage.name << "," << stage.count << "," << stage.queued/count << ","
+				<< stage.submitted/count << "," << stage.executed/count << "," << stage.total/count << ","
+				<< GBPerSecond(stage) << "," << MPixPerSecond(stage) << endl;
+		}
+		return sstream.str();
+	}
+
+	//machine readable report, CSV for a .csv file name and JSON otherwise
+	void Write(const string& file_name, const string& device_name) const {
+		ofstream file(file_name);
+		bool csv = (file_name.size() > 4) && (file_name.compare(file_name.size() - 4, 4, ".csv") == 0);
+		file << (csv ? CSV(device_name) : JSON(device_name));
+	}
+};
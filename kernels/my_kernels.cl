@@ -1,120 +1,589 @@
 
-//rgb2gray
-kernel void rgb2grey(global const uchar* A, global uchar* B, int channels) {
-	int id = get_global_id(0);
-	int image_size = get_global_size(0)/channels; //each image consists of 3 colour channels
-	int colour_channel = id / image_size; // 0 - red, 1 - green, 2 - blue
-	
-	float R = A[id + 0];  // Red component
-    float G = A[id + 1];  // Green component
-    float Bl = A[id + 2];  // Blue component
-        
-    // Calculate luminance using the formula
-    int Y = 0.2126f * R + 0.7152f * G + 0.0722f * Bl;
-
-    // Store the result in the output array
-    B[id] = Y;
-}
-
-kernel void histogram( __global uchar* data , int numData , global int* histogram, int numBins, int maxValue, __local int* localHistogram) {
-	//__local int localHistogram [256];
+//pixel layouts, must match PixelLayout in Utils.h
+#define LAYOUT_PLANAR 0 //CImg: RRR...GGG...BBB...
+#define LAYOUT_INTERLEAVED 1 //PPM files: RGBRGB... or RGBARGBA...
+
+#define LUMA(R, G, B) (0.2126f*(R) + 0.7152f*(G) + 0.0722f*(B))
+
+//colour space colour images are equalised in, must match ColourSpace in Utils.h. the program is built with
+//-DCOLOUR_SPACE=n for the ones other than LUMA. INTENSITY is the channel that gets equalised: luma (Y of YCbCr
+//too), or V = max(R, G, B) for HSV
+#define COLOUR_LUMA 0 //R, G and B scaled by the ratio of the equalised to the original luma
+#define COLOUR_YCBCR 1 //Y equalised, Cb and Cr kept
+#define COLOUR_HSV 2 //V equalised, H and S kept
+#ifndef COLOUR_SPACE
+#define COLOUR_SPACE COLOUR_LUMA
+#endif
+#if COLOUR_SPACE == COLOUR_HSV
+#define INTENSITY(R, G, B) fmax(fmax(R, G), B)
+#else
+#define INTENSITY(R, G, B) LUMA(R, G, B)
+#endif
+
+//pixel type of the images, the program is built with -DPIXEL=ushort for 16-bit images
+#ifndef PIXEL
+#define PIXEL uchar
+#endif
+#define CAT(a, b) a##b
+#define XCAT(a, b) CAT(a, b)
+#define PIXEL3 XCAT(PIXEL, 3)
+#define PIXEL4 XCAT(PIXEL, 4)
+#define PIXEL8 XCAT(PIXEL, 8)
+#define PIXEL16 XCAT(PIXEL, 16)
+#define CONVERT_PIXEL_SAT XCAT(XCAT(convert_, PIXEL), _sat)
+#define CONVERT_PIXEL3_SAT XCAT(XCAT(convert_, PIXEL3), _sat)
+#define CONVERT_PIXEL4_SAT XCAT(XCAT(convert_, PIXEL4), _sat)
+#define CONVERT_PIXEL16_SAT XCAT(XCAT(convert_, PIXEL16), _sat)
+
+//compile-time specialisation: a program built with -DNUM_BINS=n, -DCHANNELS=n or -DLAYOUT=n uses the constant in
+//place of the matching kernel argument (which is then ignored), so that loops over the bins unroll and the
+//branches on the channel count and layout go away
+#ifdef NUM_BINS
+#define BINS NUM_BINS
+#else
+#define BINS numBins
+#endif
+#ifdef CHANNELS
+#define CHANNEL_COUNT CHANNELS
+#else
+#define CHANNEL_COUNT channels
+#endif
+#ifdef LAYOUT
+#define PIXEL_LAYOUT LAYOUT
+#else
+#define PIXEL_LAYOUT layout
+#endif
+
+//histogram bin of a value in [0, maxValue). in 64 bits, as value*numBins overflows an int for 16-bit pixels.
+//maxValue is always a power of two (MaxValue on the host), so the division is a shift
+#define BIN(value, numBins, maxValue) ((int)(((long)(value)*(numBins)) >> (31 - clz(maxValue))))
+
+//pixel that sample s of an image stands for. all of them with a sampleStride of 1, otherwise the pixels are split into
+//strata of sampleStride and one is picked from each at random (a hash of s), which unlike every k-th pixel does not
+//alias with periodic patterns in the image. a tail shorter than a stratum is left out
+int SamplePixel(int s, int sampleStride) {
+	if (sampleStride == 1)
+		return s;
+	uint hash = (uint)s*2654435761u;
+	hash ^= hash >> 15;
+	return s*sampleStride + (int)(hash % (uint)sampleStride);
+}
+
+//clear the local sub-histograms of a work-group before counting
+void ZeroLocalHistogram(local int* localHistogram, int size) {
+	for (int i = get_local_id(0); i < size; i += get_local_size(0))
+		localHistogram[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//fold the replicas of the local sub-histograms together into this group's partial histogram
+void FoldReplicas(local const int* localHistogram, int replicas, global int* partialHistograms, int numBins) {
+	global int* partial = partialHistograms + get_group_id(0)*numBins;
+	for (int i = get_local_id(0); i < numBins; i += get_local_size(0)) {
+		int sum = 0;
+		for (int r = 0; r < replicas; r++)
+			sum += localHistogram[i*replicas + r];
+		partial[i] = sum;
+	}
+}
+
+//R, G and B of pixel i of a colour image in either layout (alpha is left out), one vector load for interleaved pixels
+float3 LoadRGB(global const PIXEL* A, int i, int numPixels, int channels, int layout) {
+	if (layout == LAYOUT_INTERLEAVED)
+		return (channels == 4) ? convert_float4(vload4(i, A)).xyz : convert_float3(vload3(i, A));
+	return (float3)(A[i], A[numPixels + i], A[2*numPixels + i]);
+}
+
+//write R, G and B of pixel i back the same way, copying alpha across from the input
+void StoreRGB(global const PIXEL* A, global PIXEL* out, int i, int numPixels, int channels, int layout, float3 rgb) {
+	PIXEL3 value = CONVERT_PIXEL3_SAT(rgb);
+	if (layout == LAYOUT_INTERLEAVED) {
+		if (channels == 4)
+			vstore4((PIXEL4)(value, A[4*i + 3]), i, out);
+		else
+			vstore3(value, i, out);
+		return;
+	}
+	out[i] = value.x;
+	out[numPixels + i] = value.y;
+	out[2*numPixels + i] = value.z;
+	if (channels == 4)
+		out[3*numPixels + i] = A[3*numPixels + i];
+}
+
+//intensity (INTENSITY) of pixel i of a colour image in either layout
+PIXEL Intensity(global const PIXEL* A, int i, int numPixels, int channels, int layout) {
+	float3 rgb = LoadRGB(A, i, numPixels, channels, layout);
+	return (PIXEL)INTENSITY(rgb.x, rgb.y, rgb.z);
+}
+
+//rgb2grey (INTENSITY really, luma unless the program is built for HSV) for planar images, 16 pixels per work-item with 16-wide vector loads from each plane (alpha is ignored)
+kernel void rgb2greyPlanar(global const PIXEL* A, global PIXEL* B, int numPixels, int channels) {
+	int i = get_global_id(0)*16;
+
+	if (i + 16 <= numPixels) {
+		float16 R = convert_float16(vload16(0, A + i));
+		float16 G = convert_float16(vload16(0, A + numPixels + i));
+		float16 Bl = convert_float16(vload16(0, A + 2*numPixels + i));
+		vstore16(CONVERT_PIXEL16_SAT(INTENSITY(R, G, Bl)), 0, B + i);
+	}
+	else {
+		for (; i < numPixels; i++)
+			B[i] = (PIXEL)INTENSITY((float)A[i], (float)A[numPixels + i], (float)A[2*numPixels + i]);
+	}
+}
+
+//rgb2grey for interleaved images, 4 pixels per work-item: one 16-wide load for RGBA, 8 + 4 wide for RGB
+kernel void rgb2greyInterleaved(global const PIXEL* A, global PIXEL* B, int numPixels, int channels) {
+	int i = get_global_id(0)*4;
+	global const PIXEL* pixels = A + i*CHANNEL_COUNT;
+
+	if ((i + 4 <= numPixels) && (CHANNEL_COUNT == 4)) {
+		PIXEL16 p = vload16(0, pixels);
+		float4 R = convert_float4(p.s048c);
+		float4 G = convert_float4(p.s159d);
+		float4 Bl = convert_float4(p.s26ae);
+		vstore4(CONVERT_PIXEL4_SAT(INTENSITY(R, G, Bl)), 0, B + i);
+	}
+	else if ((i + 4 <= numPixels) && (CHANNEL_COUNT == 3)) {
+		PIXEL8 lo = vload8(0, pixels); //R0 G0 B0 R1 G1 B1 R2 G2
+		PIXEL4 hi = vload4(0, pixels + 8); //B2 R3 G3 B3
+		float4 R = convert_float4((PIXEL4)(lo.s0, lo.s3, lo.s6, hi.s1));
+		float4 G = convert_float4((PIXEL4)(lo.s1, lo.s4, lo.s7, hi.s2));
+		float4 Bl = convert_float4((PIXEL4)(lo.s2, lo.s5, hi.s0, hi.s3));
+		vstore4(CONVERT_PIXEL4_SAT(INTENSITY(R, G, Bl)), 0, B + i);
+	}
+	else {
+		for (; i < numPixels; i++, pixels += CHANNEL_COUNT)
+			B[i] = (PIXEL)INTENSITY((float)pixels[0], (float)pixels[1], (float)pixels[2]);
+	}
+}
+
+//per-work-group histogram: a grid-stride loop over all pixels (or a sample, see SamplePixel) bins into local sub-histograms, replicated
+//`replicas` times (interleaved per bin) so that neighbouring work-items do not fight over the same counter.
+//each work-group then writes its own partial histogram, so no global atomics are needed
+kernel void histogram(global const PIXEL* data, int numData, global int* partialHistograms, int numBins, int maxValue, local int* localHistogram, int replicas, int sampleStride) {
 	int lid = get_local_id(0);
 	int gid = get_global_id(0);
-	for ( int i = lid ; i < numBins; i += get_local_size(0))
-	{
-		localHistogram[i] = 0;
+	int replica = lid % replicas;
+
+	ZeroLocalHistogram(localHistogram, BINS*replicas);
+
+	for (int s = gid; s < numData/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		atomic_inc(&localHistogram[BIN(data[i], BINS, maxValue)*replicas + replica]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistogram, replicas, partialHistograms, BINS);
+}
+
+//rgb2grey and histogram in one pass for colour images: the luminance of each pixel is computed in registers
+//and binned straight into the local sub-histograms, so the grey plane never has to go through global memory.
+//it is only written out when writeGrey is set. same replication and partial histogram output as histogram
+kernel void rgb2greyHistogram(global const PIXEL* A, int numPixels, int channels, int layout, global PIXEL* grey, int writeGrey,
+	global int* partialHistograms, int numBins, int maxValue, local int* localHistogram, int replicas, int sampleStride) {
+	int lid = get_local_id(0);
+	int gid = get_global_id(0);
+	int replica = lid % replicas;
+
+	ZeroLocalHistogram(localHistogram, BINS*replicas);
+
+	for (int s = gid; s < numPixels/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		PIXEL intensity = Intensity(A, i, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT);
+		if (writeGrey)
+			grey[i] = intensity;
+		atomic_inc(&localHistogram[BIN(intensity, BINS, maxValue)*replicas + replica]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistogram, replicas, partialHistograms, BINS);
+}
+
+//histogram and rgb2greyHistogram for skewed images (dark frames, flat backgrounds, anything mostly one value),
+//where every work-item would queue on the same local counter: each work-item counts runs of equal bins in a
+//private counter and only goes to the local histogram when the bin changes or at the end, one atomic_add per run
+kernel void histogramRuns(global const PIXEL* data, int numData, global int* partialHistograms, int numBins, int maxValue, local int* localHistogram, int replicas, int sampleStride) {
+	int lid = get_local_id(0);
+	int replica = lid % replicas;
+
+	ZeroLocalHistogram(localHistogram, BINS*replicas);
+
+	int runBin = 0;
+	int runLength = 0;
+	for (int s = get_global_id(0); s < numData/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		int bin = BIN(data[i], BINS, maxValue);
+		if (bin != runBin) {
+			if (runLength > 0)
+				atomic_add(&localHistogram[runBin*replicas + replica], runLength);
+			runBin = bin;
+			runLength = 0;
+		}
+		runLength++;
 	}
-	barrier (CLK_LOCAL_MEM_FENCE);
+	if (runLength > 0)
+		atomic_add(&localHistogram[runBin*replicas + replica], runLength);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistogram, replicas, partialHistograms, BINS);
+}
 
-	for ( int i = gid; i < numData; i += get_global_size(0))
-	{
-		if(gid < numData) {
-			int binIndex = (data[gid]*numBins)/maxValue;
-			atomic_add(&localHistogram[binIndex], 1);
+kernel void rgb2greyHistogramRuns(global const PIXEL* A, int numPixels, int channels, int layout, global PIXEL* grey, int writeGrey,
+	global int* partialHistograms, int numBins, int maxValue, local int* localHistogram, int replicas, int sampleStride) {
+	int lid = get_local_id(0);
+	int replica = lid % replicas;
+
+	ZeroLocalHistogram(localHistogram, BINS*replicas);
+
+	int runBin = 0;
+	int runLength = 0;
+	for (int s = get_global_id(0); s < numPixels/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		PIXEL intensity = Intensity(A, i, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT);
+		if (writeGrey)
+			grey[i] = intensity;
+		int bin = BIN(intensity, BINS, maxValue);
+		if (bin != runBin) {
+			if (runLength > 0)
+				atomic_add(&localHistogram[runBin*replicas + replica], runLength);
+			runBin = bin;
+			runLength = 0;
 		}
+		runLength++;
+	}
+	if (runLength > 0)
+		atomic_add(&localHistogram[runBin*replicas + replica], runLength);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistogram, replicas, partialHistograms, BINS);
+}
+
+//histogram and rgb2greyHistogram for bin counts that do not fit in local memory (up to 65536 for 16-bit images):
+//each work-group counts into its own partial histogram in global memory with global atomics, so the groups
+//still never contend with each other and the same reduceHistogram applies
+kernel void histogramGlobal(global const PIXEL* data, int numData, global int* partialHistograms, int numBins, int maxValue, int sampleStride) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	global int* partial = partialHistograms + get_group_id(0)*BINS;
+
+	for (int i = lid; i < BINS; i += lsize)
+		partial[i] = 0;
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	for (int s = get_global_id(0); s < numData/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		atomic_inc(&partial[BIN(data[i], BINS, maxValue)]);
+	}
+}
+
+kernel void rgb2greyHistogramGlobal(global const PIXEL* A, int numPixels, int channels, int layout, global PIXEL* grey, int writeGrey,
+	global int* partialHistograms, int numBins, int maxValue, int sampleStride) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	global int* partial = partialHistograms + get_group_id(0)*BINS;
+
+	for (int i = lid; i < BINS; i += lsize)
+		partial[i] = 0;
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	for (int s = get_global_id(0); s < numPixels/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		PIXEL intensity = Intensity(A, i, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT);
+		if (writeGrey)
+			grey[i] = intensity;
+		atomic_inc(&partial[BIN(intensity, BINS, maxValue)]);
 	}
-	barrier (CLK_LOCAL_MEM_FENCE);
-	for ( int i = lid ; i < numBins; i += get_local_size(0))
-	{
-		atomic_add(&histogram[i], localHistogram[i]);
+}
+
+//second histogram pass: each work-item sums one bin over all partial histograms.
+//with accumulate set the sum is added to the histogram already there, for images that arrive in bands
+kernel void reduceHistogram(global const int* partialHistograms, int numPartials, global int* histogram, int numBins, int accumulate) {
+	int bin = get_global_id(0);
+
+	if (bin < BINS) {
+		int sum = accumulate ? histogram[bin] : 0;
+		for (int g = 0; g < numPartials; g++)
+			sum += partialHistograms[g*BINS + bin];
+		histogram[bin] = sum;
+	}
+}
+
+//R, G, B and luma histograms of a colour image from one read of every pixel (or a sample): four local histograms
+//side by side - R, G, B, then luma, BINS each - all binned over [0, maxValue). every work-group writes a partial
+//of 4*BINS for reduceChannelHistograms
+kernel void channelHistograms(global const PIXEL* A, int numPixels, int channels, int layout, global int* partialHistograms,
+	int numBins, int maxValue, local int* localHistograms, int sampleStride) {
+	ZeroLocalHistogram(localHistograms, 4*BINS);
+
+	for (int s = get_global_id(0); s < numPixels/sampleStride; s += get_global_size(0)) {
+		int i = SamplePixel(s, sampleStride);
+		float3 rgb = LoadRGB(A, i, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT);
+		atomic_inc(&localHistograms[BIN((int)rgb.x, BINS, maxValue)]);
+		atomic_inc(&localHistograms[BINS + BIN((int)rgb.y, BINS, maxValue)]);
+		atomic_inc(&localHistograms[2*BINS + BIN((int)rgb.z, BINS, maxValue)]);
+		atomic_inc(&localHistograms[3*BINS + BIN((PIXEL)LUMA(rgb.x, rgb.y, rgb.z), BINS, maxValue)]);
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistograms, 1, partialHistograms, 4*BINS);
 }
 
-kernel void scanBL(global int* A) {
-	int id = get_global_id(0);
-	int N = get_global_size(0);
-	int t;
+//reduceHistogram for the four histograms of channelHistograms
+kernel void reduceChannelHistograms(global const int* partialHistograms, int numPartials, global int* histograms, int numBins) {
+	int bin = get_global_id(0);
+
+	if (bin < 4*BINS) {
+		int sum = 0;
+		for (int g = 0; g < numPartials; g++)
+			sum += partialHistograms[g*4*BINS + bin];
+		histograms[bin] = sum;
+	}
+}
+
+//work-group scan (Blelloch) of one block of 2*local_size elements in local memory. the block total goes to
+//blockSums so that scanAddBlockSums can carry it into the following blocks - any length is handled this way.
+//local size has to be a power of two; input and output may be the same buffer
+kernel void scanLocal(global const int* input, global int* output, int n, global int* blockSums, local int* temp, int inclusive) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int blockSize = 2*lsize;
+	int offset = get_group_id(0)*blockSize;
+	int ai = 2*lid;
+	int bi = 2*lid + 1;
+
+	int a = (offset + ai < n) ? input[offset + ai] : 0;
+	int b = (offset + bi < n) ? input[offset + bi] : 0;
+	temp[ai] = a;
+	temp[bi] = b;
 
 	//up-sweep
-	for (int stride = 1; stride < N; stride *= 2) {
-		if (((id + 1) % (stride*2)) == 0)
-			A[id] += A[id - stride];
+	int stride = 1;
+	for (int d = lsize; d > 0; d >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d)
+			temp[stride*(2*lid + 2) - 1] += temp[stride*(2*lid + 1) - 1];
+		stride *= 2;
+	}
 
-		barrier(CLK_GLOBAL_MEM_FENCE); //sync the step
+	//keep the block total and clear the root for the exclusive down-sweep
+	if (lid == 0) {
+		blockSums[get_group_id(0)] = temp[blockSize - 1];
+		temp[blockSize - 1] = 0;
 	}
 
 	//down-sweep
-	if (id == 0)
-		A[N-1] = 0;//exclusive scan
+	for (int d = 1; d < blockSize; d *= 2) {
+		stride >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			int i = stride*(2*lid + 1) - 1;
+			int j = stride*(2*lid + 2) - 1;
+			int t = temp[i];
+			temp[i] = temp[j];
+			temp[j] += t;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	barrier(CLK_GLOBAL_MEM_FENCE); //sync the step
+	if (offset + ai < n)
+		output[offset + ai] = temp[ai] + (inclusive ? a : 0);
+	if (offset + bi < n)
+		output[offset + bi] = temp[bi] + (inclusive ? b : 0);
+}
 
-	for (int stride = N/2; stride > 0; stride /= 2) {
-		if (((id + 1) % (stride*2)) == 0) {
-			t = A[id];
-			A[id] += A[id - stride]; //reduce 
-			A[id - stride] = t;		 //move
-		}
+//add the scanned (exclusive) block totals back into every block, launched with the same geometry as scanLocal
+kernel void scanAddBlockSums(global int* data, int n, global const int* blockOffsets) {
+	int i = get_group_id(0)*2*get_local_size(0) + 2*get_local_id(0);
+	int offset = blockOffsets[get_group_id(0)];
 
-		barrier(CLK_GLOBAL_MEM_FENCE); //sync the step
-	}
+	if (i < n)
+		data[i] += offset;
+	if (i + 1 < n)
+		data[i + 1] += offset;
 }
 
-kernel void normalise(global float* histogram, const uint NumberOfPixels){
+//cumulative histogram to [0,1], the last bin of an inclusive scan holds the pixel count
+kernel void normalise(global const int* cdf, global float* normalised, const int numBins) {
 	int gid = get_global_id(0);
-	int N = get_global_size(0);
 
-	if (gid < NumberOfPixels) {
-		histogram[gid] = histogram[gid]/histogram[N-1];
+	if (gid < BINS) {
+		normalised[gid] = (float)cdf[gid]/cdf[BINS-1];
 	}
 }
 
-kernel void scaled(global float* histogram, global int* scaledHistogram, const int numBins, const int maxValue) {
+kernel void scaled(global const float* histogram, global int* scaledHistogram, const int numBins, const int maxValue) {
 	int gid = get_global_id(0);
-	if (gid < numBins) {
+	if (gid < BINS) {
 		scaledHistogram[gid] = (int) (histogram[gid]*(maxValue-1.0f));
 	}
 }
 
-kernel void backProjection(global const uchar* greyImage, global uchar* backProjImage, global const int* scaledHistogram, int scaleFactor) {
-    int gid = get_global_id(0);
+//normalise + scaled in one step: cumulative histogram straight to the equalisation LUT
+kernel void cdfToLut(global const int* cdf, global int* lut, const int numBins, const int maxValue) {
+	int gid = get_global_id(0);
 
-    if (gid == 0) {
-        printf("First pixel intensity: %d\n", greyImage[gid]);
-        printf("Scaled value: %d\n", scaledHistogram[greyImage[gid]]);
-    }
-	int intensity = greyImage[gid]/scaleFactor;
-    backProjImage[gid] = scaledHistogram[intensity];
+	if (gid < BINS) {
+		lut[gid] = (int) (((float)cdf[gid]/cdf[BINS-1])*(maxValue-1.0f));
+	}
+}
 
+//grey back-projection through the LUT. the work-items stride over the image, so that each one can be given
+//several pixels (the autotuner picks how many)
+kernel void backProjection(global const PIXEL* greyImage, global PIXEL* backProjImage, global const int* scaledHistogram, int numBins, int maxValue, int numPixels) {
+	for (int gid = get_global_id(0); gid < numPixels; gid += get_global_size(0)) {
+		int binIndex = BIN(greyImage[gid], BINS, maxValue);
+		backProjImage[gid] = scaledHistogram[binIndex];
+	}
+}
+
+//BT.709 YCbCr, the same Y as LUMA. Cb and Cr are not offset, they never leave the kernel
+float3 RGBToYCbCr(float3 rgb) {
+	float Y = LUMA(rgb.x, rgb.y, rgb.z);
+	return (float3)(Y, (rgb.z - Y)/1.8556f, (rgb.x - Y)/1.5748f);
+}
+
+float3 YCbCrToRGB(float3 ycc) {
+	float R = ycc.x + 1.5748f*ycc.z;
+	float Bl = ycc.x + 1.8556f*ycc.y;
+	return (float3)(R, (ycc.x - 0.2126f*R - 0.0722f*Bl)/0.7152f, Bl);
+}
+
+//a colour pixel with its intensity taken from intensity to equalised, in the program's colour space. for HSV
+//scaling R, G and B by the ratio of V is exactly the round trip through H, S and V with only V changed
+float3 EqualiseRGB(float3 rgb, int intensity, float equalised) {
+#if COLOUR_SPACE == COLOUR_YCBCR
+	float3 ycc = RGBToYCbCr(rgb);
+	return YCbCrToRGB((float3)(equalised, ycc.y, ycc.z));
+#else
+	if (intensity > 0)
+		return rgb*(equalised/intensity);
+	return (float3)(equalised);
+#endif
+}
+
+//colour back-projection in one pass: each pixel is converted, its intensity equalised through the LUT and converted
+//back (EqualiseRGB), alpha is copied through. work-items stride over the pixels as for the grey one, layout as for rgb2grey
+kernel void backProjRGBA(global const PIXEL* colourImage, global PIXEL* backProjImage, global const int* scaledHistogram, const int maxValue, const int channels, const int numBins, const int numPixels, const int layout) {
+	for (int gid = get_global_id(0); gid < numPixels; gid += get_global_size(0)) {
+		float3 rgb = LoadRGB(colourImage, gid, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT);
+		int intensity = (int)INTENSITY(rgb.x, rgb.y, rgb.z);
+		int binIndex = BIN(intensity, BINS, maxValue);
+		StoreRGB(colourImage, backProjImage, gid, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT, EqualiseRGB(rgb, intensity, (float)scaledHistogram[binIndex]));
+	}
+}
+
+//CLAHE (contrast limited adaptive histogram equalisation): the image is split into tilesX x tilesY tiles of
+//tileWidth x tileHeight pixels (smaller in the last column and row), every tile gets its own clipped LUT and each
+//pixel is mapped through the LUTs of the four nearest tile centres, interpolated bilinearly
+
+//histogram of every tile in one launch: one work-group per tile, counting into local memory
+kernel void claheHistogram(global const PIXEL* A, int width, int height, int channels, int layout, int tilesX, int tileWidth, int tileHeight,
+	global int* tileHistograms, int numBins, int maxValue, local int* localHistogram) {
+	int tile = get_group_id(0);
+	int x0 = (tile % tilesX)*tileWidth;
+	int y0 = (tile / tilesX)*tileHeight;
+	int w = min(tileWidth, width - x0);
+	int h = min(tileHeight, height - y0);
+	int numPixels = width*height;
+
+	ZeroLocalHistogram(localHistogram, BINS);
+
+	for (int i = get_local_id(0); i < w*h; i += get_local_size(0)) {
+		int pixel = (y0 + i/w)*width + x0 + i%w;
+		PIXEL value = (CHANNEL_COUNT >= 3) ? Intensity(A, pixel, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT) : A[pixel];
+		atomic_inc(&localHistogram[BIN(value, BINS, maxValue)]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	FoldReplicas(localHistogram, 1, tileHistograms, BINS);
 }
 
-kernel void backProjRGBA(global const uchar* colourImage, global uchar* backProjImage, global const int* scaledHistogram, const int maxValue, const int channels, int binScale) {
-    int gid = get_global_id(0);  // Pixel index
-    int image_size = get_global_size(0)/channels;
+//clip every tile histogram at clipLimit, share the excess out evenly over all bins and turn the cumulative result
+//into the tile's LUT (as cdfToLut). one work-group per tile: each work-item scans a contiguous chunk of bins in
+//local memory, then the chunk totals are scanned and added back. with a clip limit of INT_MAX this is the plain
+//LUT of each of a set of histograms, as for channelHistograms
+kernel void claheLut(global const int* tileHistograms, global int* tileLuts, int numBins, int maxValue, int clipLimit, local int* cdf, local int* chunkSums) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	global const int* histogram = tileHistograms + get_group_id(0)*BINS;
+	global int* lut = tileLuts + get_group_id(0)*BINS;
+	local int excess;
 
-    float R = colourImage[gid + 0];  // Red component
-    float G = colourImage[gid + 1];  // Green component
-    float Bl = colourImage[gid + 2];  // Blue component
+	int chunk = (BINS + lsize - 1)/lsize;
+	int begin = min(lid*chunk, BINS);
+	int end = min(begin + chunk, BINS);
 
-    int intensity = (0.2126f * R + 0.7152f * G + 0.0722f * Bl)/binScale;
+	if (lid == 0)
+		excess = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	int over = 0;
+	for (int i = begin; i < end; i++)
+		over += max(histogram[i] - clipLimit, 0);
+	atomic_add(&excess, over);
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-    float scaleFactor = scaledHistogram[intensity]; // Normalize LUT value to [0,1]
+	int share = excess/BINS;
+	int remainder = excess%BINS;
+	int sum = 0;
+	for (int i = begin; i < end; i++) {
+		sum += min(histogram[i], clipLimit) + share + ((i < remainder) ? 1 : 0);
+		cdf[i] = sum;
+	}
+	chunkSums[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-    backProjImage[gid] = (R * scaleFactor);
-    backProjImage[gid + 1] = (G * scaleFactor);
-    backProjImage[gid + 2] = (Bl * scaleFactor);
-	if (channels == 4) {
-		int A = colourImage[gid + 3];
-		backProjImage[gid + 3] = A;
+	//exclusive scan of the chunk totals, there are only as many as work-items
+	if (lid == 0) {
+		int total = 0;
+		for (int c = 0; c < lsize; c++) {
+			int chunkSum = chunkSums[c];
+			chunkSums[c] = total;
+			total += chunkSum;
+		}
 	}
-}
\ No newline at end of file
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = begin; i < end; i++)
+		cdf[i] += chunkSums[lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	float total = cdf[BINS - 1];
+	for (int i = begin; i < end; i++)
+		lut[i] = (int)((cdf[i]/total)*(maxValue - 1.0f));
+}
+
+//map every pixel through the LUTs of the four tiles whose centres surround it (two along the edges, one in the
+//corners) and interpolate bilinearly. colour pixels go through EqualiseRGB as in backProjRGBA
+kernel void claheApply(global const PIXEL* A, global PIXEL* out, global const int* tileLuts, int width, int height, int channels, int layout,
+	int tilesX, int tilesY, int tileWidth, int tileHeight, int numBins, int maxValue) {
+	int numPixels = width*height;
+
+	for (int gid = get_global_id(0); gid < numPixels; gid += get_global_size(0)) {
+		int x = gid%width;
+		int y = gid/width;
+
+		//position in the grid of tile centres
+		float fx = (x + 0.5f)/tileWidth - 0.5f;
+		float fy = (y + 0.5f)/tileHeight - 0.5f;
+		int tx0 = clamp((int)floor(fx), 0, tilesX - 1);
+		int ty0 = clamp((int)floor(fy), 0, tilesY - 1);
+		int tx1 = min(tx0 + 1, tilesX - 1);
+		int ty1 = min(ty0 + 1, tilesY - 1);
+		float wx = clamp(fx - tx0, 0.0f, 1.0f);
+		float wy = clamp(fy - ty0, 0.0f, 1.0f);
+
+		float3 rgb = (CHANNEL_COUNT >= 3) ? LoadRGB(A, gid, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT) : (float3)(A[gid]);
+		int intensity = (CHANNEL_COUNT >= 3) ? (int)INTENSITY(rgb.x, rgb.y, rgb.z) : A[gid];
+		int bin = BIN(intensity, BINS, maxValue);
+
+		float top = mix((float)tileLuts[(ty0*tilesX + tx0)*BINS + bin], (float)tileLuts[(ty0*tilesX + tx1)*BINS + bin], wx);
+		float bottom = mix((float)tileLuts[(ty1*tilesX + tx0)*BINS + bin], (float)tileLuts[(ty1*tilesX + tx1)*BINS + bin], wx);
+		float equalised = mix(top, bottom, wy);
+
+		if (CHANNEL_COUNT >= 3)
+			StoreRGB(A, out, gid, numPixels, CHANNEL_COUNT, PIXEL_LAYOUT, EqualiseRGB(rgb, intensity, equalised));
+		else
+			out[gid] = CONVERT_PIXEL_SAT(equalised);
+	}
+}